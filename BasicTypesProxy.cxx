@@ -1,14 +1,30 @@
 #include "SRProxy/BasicTypesProxy.h"
 
+#include "SRProxy/ColumnarFile.h"
+
 #include "TError.h"
 #include "TFile.h"
 #include "TFormLeafInfo.h"
+#include "TFriendElement.h"
+#include "TROOT.h"
+#include "TTree.h"
+#include "TTreeCacheUnzip.h"
 #include "TTreeFormula.h"
 
 #include <algorithm>
 #include <cassert>
+#include <cerrno>
+#include <cstring>
 #include <iostream>
 #include <fstream>
+#include <map>
+#include <tuple>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 using namespace std::string_literals;
 
@@ -109,6 +125,37 @@ namespace
   };
 
   InfNanTable infNanTable;
+
+  /// \brief The \a X that every user of \a key in tree \a tr shares,
+  /// constructed by \a make if there isn't one
+  ///
+  /// The users own the objects, so they go when the proxy tree does. Their
+  /// entries are erased then too (on lookup, and in a sweep every so often)
+  /// so that a tree allocated later at the same address starts afresh.
+  template<class X, class F>
+  std::shared_ptr<X> GetShared(TTree* tr, const std::string& key, F make)
+  {
+    static std::map<std::pair<TTree*, std::string>, std::weak_ptr<X>> reg;
+    static size_t nextSweep = 64;
+
+    auto it = reg.find({tr, key});
+    if(it != reg.end()){
+      if(std::shared_ptr<X> ret = it->second.lock()) return ret;
+      reg.erase(it);
+    }
+
+    // Amortized over the insertions
+    if(reg.size() >= nextSweep){
+      for(auto jt = reg.begin(); jt != reg.end();){
+        if(jt->second.expired()) jt = reg.erase(jt); else ++jt;
+      }
+      nextSweep = 2*reg.size() + 64;
+    }
+
+    std::shared_ptr<X> ret = make();
+    reg.emplace(std::make_pair(tr, key), ret);
+    return ret;
+  }
 }
 
 namespace caf
@@ -116,8 +163,22 @@ namespace caf
   std::vector<Restorer*> SRProxySystController::fRestorers;
   long long SRProxySystController::fGeneration = 0;
 
+  std::unordered_map<const TTree*, long long> VectorProxyBase::fgAssigned;
+
   std::set<std::string> SRBranchRegistry::fgBranches;
 
+  long long SRBoundRecord::fgEvent = 0;
+
+  std::vector<SRDependency>* SRDependencyTracker::fgCurrent = 0;
+  long long SRDependencyTracker::fgStamp = 0;
+
+  size_t SRColumnCache::fgMaxBytes = 0;
+  size_t SRColumnCache::fgBytesUsed = 0;
+
+  thread_local TTree* SRColumnTable::fgTree = 0;
+  thread_local std::unordered_map<std::string, int> SRColumnTable::fgBranchIdx;
+  thread_local std::vector<int> SRColumnTable::fgColIdx;
+
   //----------------------------------------------------------------------
   void SRBranchRegistry::Print(bool abbrev)
   {
@@ -143,11 +204,593 @@ namespace caf
     for(const std::string& b: fgBranches) fout << b << std::endl;
   }
 
+  //----------------------------------------------------------------------
+  std::set<std::string> SRBranchRegistry::WithIndexFields(const std::set<std::string>& branches)
+  {
+    std::set<std::string> ret = branches;
+    for(const std::string& b: branches){
+      // Every prefix foo.bar of foo.bar.baz may be a vector
+      for(size_t pos = b.find('.'); ; pos = b.find('.', pos+1)){
+        const std::string prefix = b.substr(0, pos);
+        ret.insert(prefix+"..length");
+        ret.insert(prefix+"..idx");
+        if(pos == std::string::npos) break;
+      }
+    }
+    return ret;
+  }
+
+  //----------------------------------------------------------------------
+  std::vector<const char*>& SRColumnTable::Paths()
+  {
+    static std::vector<const char*> paths;
+    return paths;
+  }
+
+  //----------------------------------------------------------------------
+  void SRColumnTable::SetPaths(const char* const* paths, int n)
+  {
+    Paths().assign(paths, paths+n);
+  }
+
+  //----------------------------------------------------------------------
+  const char* SRColumnTable::Path(ColumnID id)
+  {
+    if(id < 0 || id >= NColumns()) return "";
+    return Paths()[id];
+  }
+
+  //----------------------------------------------------------------------
+  ColumnID SRColumnTable::Find(const std::string& path)
+  {
+    for(int id = 0; id < NColumns(); ++id) if(path == Paths()[id]) return id;
+    return kNoColumn;
+  }
+
+  //----------------------------------------------------------------------
+  void SRColumnTable::IndexTree(TTree* tr)
+  {
+    fgTree = tr;
+    fgBranchIdx.clear();
+
+    const TObjArray* brs = tr->GetListOfBranches();
+    for(int i = 0; i < brs->GetEntriesFast(); ++i){
+      fgBranchIdx.emplace(brs->UncheckedAt(i)->GetName(), i);
+    }
+  }
+
+  //----------------------------------------------------------------------
+  TBranch* SRColumnTable::GetBranch(TTree* tr, ColumnID id,
+                                    const std::string& sname)
+  {
+    if(id < 0 || id >= NColumns()) return tr->GetBranch(sname.c_str());
+
+    const TObjArray* brs = tr->GetListOfBranches();
+
+    auto IsAt = [brs, &sname](int idx){
+      return idx >= 0 && idx < brs->GetEntriesFast() &&
+        sname == brs->UncheckedAt(idx)->GetName();
+    };
+
+    if(fgColIdx.empty()) fgColIdx.resize(NColumns(), -1);
+
+    // Most trees share a layout, so the position found for the previous tree
+    // is usually still right. Validating it is a single string comparison.
+    int& idx = fgColIdx[id];
+    if(IsAt(idx)) return (TBranch*)brs->UncheckedAt(idx);
+
+    for(int attempt = 0; attempt < 2; ++attempt){
+      // Tree pointers can be reused, so a failed lookup against a supposedly
+      // indexed tree gets one retry with a fresh index
+      if(tr != fgTree || attempt > 0) IndexTree(tr);
+
+      auto it = fgBranchIdx.find(sname);
+      if(it != fgBranchIdx.end() && IsAt(it->second)){
+        idx = it->second;
+        return (TBranch*)brs->UncheckedAt(idx);
+      }
+    }
+
+    // Not a top-level branch of this tree
+    idx = -1;
+    return tr->GetBranch(sname.c_str());
+  }
+
+  //----------------------------------------------------------------------
+  template<class T> void GetTypedValueWrapper(TLeaf* leaf, T& x, int subidx)
+  {
+    x = leaf->GetTypedValue<T>(subidx);
+  }
+
+  //----------------------------------------------------------------------
+  void GetTypedValueWrapper(TLeaf* leaf, std::string& x, int subidx)
+  {
+    assert(subidx == 0); // Unused for flat trees at least
+    x = (char*)leaf->GetValuePointer();
+  }
+
+  /// Type-erased base so that columns of all types can share a container
+  class SRCachedColumnBase
+  {
+  public:
+    virtual ~SRCachedColumnBase() = default;
+  };
+
+  /// The values of one flat branch, for the entries that have been read
+  template<class U> class SRCachedColumn: public SRCachedColumnBase
+  {
+  public:
+    SRCachedColumn() : fBytes(0), fAbandoned(false) {}
+    ~SRCachedColumn(){SRColumnCache::Release(fBytes);}
+
+    bool Abandoned() const {return fAbandoned;}
+
+    /// Returns false if \a entry wasn't recorded, or \a subidx is out of
+    /// range for it
+    bool Get(long entry, int subidx, U& x) const
+    {
+      if(entry < 0 || entry >= long(fStart.size()) || fStart[entry] == kAbsent) return false;
+      if(subidx < 0 || subidx >= fLen[entry]) return false;
+      x = fVals[fStart[entry] + subidx];
+      return true;
+    }
+
+    /// Record \a entry, which leaves \a br loaded at it. Returns false if
+    /// the column had to be abandoned because the cache is full.
+    bool Fill(TBranch* br, TLeaf* leaf, long entry)
+    {
+      if(fAbandoned) return false;
+      if(entry < long(fStart.size()) && fStart[entry] != kAbsent) return true;
+
+      br->GetEntry(entry);
+
+      // Strings are a single value per entry
+      const int n = std::is_same_v<U, std::string> ? 1 : leaf->GetLen();
+
+      // Entries skipped so far only cost their place in the index
+      size_t bytes = 0;
+      if(entry >= long(fStart.size())) bytes += (entry+1-fStart.size())*(sizeof(size_t)+sizeof(int));
+
+      const size_t first = fVals.size();
+      for(int i = 0; i < n; ++i){
+        U x;
+        GetTypedValueWrapper(leaf, x, i);
+        fVals.push_back(std::move(x));
+        // Including what the string holds on the heap
+        if constexpr(std::is_same_v<U, std::string>) bytes += sizeof(U) + fVals.back().capacity();
+        else bytes += sizeof(U);
+      }
+
+      if(!SRColumnCache::Reserve(bytes)){
+        Abandon();
+        return false;
+      }
+      fBytes += bytes;
+
+      if(entry >= long(fStart.size())){
+        fStart.resize(entry+1, kAbsent);
+        fLen.resize(entry+1, 0);
+      }
+      fStart[entry] = first;
+      fLen[entry] = n;
+
+      return true;
+    }
+
+  protected:
+    static constexpr size_t kAbsent = size_t(-1);
+
+    void Abandon()
+    {
+      fAbandoned = true;
+      std::vector<U>().swap(fVals);
+      std::vector<size_t>().swap(fStart);
+      std::vector<int>().swap(fLen);
+      SRColumnCache::Release(fBytes);
+      fBytes = 0;
+    }
+
+    /// In the order the entries were read, which need not be entry order
+    std::vector<U> fVals;
+    std::vector<size_t> fStart; ///< Index of each entry's first value in fVals, or kAbsent
+    std::vector<int> fLen;      ///< Number of values of each entry
+    size_t fBytes;
+    bool fAbandoned;
+  };
+
+  namespace
+  {
+    /// Keyed by file:tree:branch
+    std::map<std::string, std::shared_ptr<SRCachedColumnBase>> gCachedColumns;
+  }
+
+  //----------------------------------------------------------------------
+  void SRColumnCache::clear()
+  {
+    // Proxies that are still alive keep their columns until they're done
+    gCachedColumns.clear();
+  }
+
+  //----------------------------------------------------------------------
+  bool SRColumnCache::Reserve(size_t bytes)
+  {
+    if(fgBytesUsed + bytes > fgMaxBytes) return false;
+    fgBytesUsed += bytes;
+    return true;
+  }
+
+  //----------------------------------------------------------------------
+  template<class U> std::shared_ptr<SRCachedColumn<U>>
+  SRColumnCache::GetColumn(TTree* tr, const std::string& branch)
+  {
+    if(fgMaxBytes == 0) return 0;
+
+    // In-memory trees will never be read a second time
+    const TFile* f = tr->GetCurrentFile();
+    if(!f) return 0;
+
+    const std::string key = f->GetName()+":"s+tr->GetName()+":"+branch;
+
+    std::shared_ptr<SRCachedColumnBase>& col = gCachedColumns[key];
+    if(!col) col = std::make_shared<SRCachedColumn<U>>();
+
+    auto ret = std::dynamic_pointer_cast<SRCachedColumn<U>>(col);
+    if(!ret || ret->Abandoned()) return 0;
+    return ret;
+  }
+
+  //----------------------------------------------------------------------
+  bool SRSharedCache::fgInit = false;
+  size_t SRSharedCache::fgMaxBytes = 0;
+  std::string SRSharedCache::fgDir;
+  size_t SRSharedCache::fgBytesSinceTrim = 0;
+
+  namespace
+  {
+    const char kSharedMagic[8] = {'S', 'R', 'P', 'X', 'S', 'H', 'M', '1'};
+
+    /// Layout of a published cluster. Followed by the key, padded to 8
+    /// bytes, the nEntries+1 offsets of each entry's first value, and the
+    /// values themselves.
+    struct SRSharedHeader
+    {
+      char magic[8];
+      uint64_t keyLen;
+      int64_t begin, end; ///< Entries of the cluster
+      uint64_t nVals;
+    };
+
+    /// FNV-1a, which unlike std::hash is guaranteed the same in every job
+    uint64_t StableHash(const std::string& s)
+    {
+      uint64_t h = 14695981039346656037ull;
+      for(char c: s){
+        h ^= (unsigned char)c;
+        h *= 1099511628211ull;
+      }
+      return h;
+    }
+
+    /// Distinguish e.g. int from float in the key
+    template<class U> std::string TypeTag()
+    {
+      return std::to_string(sizeof(U)) + (std::is_floating_point_v<U> ? "f" : std::is_signed_v<U> ? "i" : "u");
+    }
+  }
+
+  /// The values of one flat branch, a whole cluster at a time, either mapped
+  /// from a file published by another job or decoded and published here
+  template<class U> class SRSharedColumn
+  {
+  public:
+    SRSharedColumn() : fTree(0), fFile(0), fBegin(0), fEnd(0),
+                       fMap(0), fMapSize(0), fOffsets(0), fVals(0)
+    {
+    }
+
+    ~SRSharedColumn(){Unmap();}
+
+    /// Value \a subidx of the current entry of \a br's tree. Returns false
+    /// if there is no such value
+    bool Get(TBranch* br, TLeaf* leaf, int subidx, U& x)
+    {
+      TTree* tr = br->GetTree();
+      const long long entry = tr->GetReadEntry();
+      if(tr != fTree || tr->GetCurrentFile() != fFile ||
+         entry < fBegin || entry >= fEnd) Load(br, leaf, entry);
+      if(entry < fBegin || entry >= fEnd) return false; // no such cluster
+
+      const uint64_t idx = fOffsets[entry-fBegin] + subidx;
+      if(subidx < 0 || idx >= fOffsets[entry-fBegin+1]) return false;
+      x = fVals[idx];
+      return true;
+    }
+
+  protected:
+    void Load(TBranch* br, TLeaf* leaf, long long entry)
+    {
+      Unmap();
+
+      fTree = br->GetTree();
+      fFile = fTree->GetCurrentFile();
+
+      TTree::TClusterIterator it = fTree->GetClusterIterator(entry);
+      fBegin = it.Next();
+      fEnd = it.GetNextEntry();
+
+      const std::string key = fFile->GetUUID().AsString() + ":"s + fTree->GetName() + ":" +
+        br->GetName() + ":" + TypeTag<U>() + ":" + std::to_string(fBegin);
+      char hash[17];
+      snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)StableHash(key));
+      const std::string path = SRSharedCache::GetDirectory() + "/" + hash;
+
+      if(Map(path, key)) return;
+
+      // Nobody has it yet. Decode the cluster into the same layout as the
+      // file, so it can be used in place whether or not publishing works.
+      std::vector<uint64_t> offsets(1, 0);
+      std::vector<U> vals;
+      for(long long e = fBegin; e < fEnd; ++e){
+        br->GetEntry(e);
+        const int n = leaf->GetLen();
+        for(int i = 0; i < n; ++i){
+          U x;
+          GetTypedValueWrapper(leaf, x, i);
+          vals.push_back(x);
+        }
+        offsets.push_back(vals.size());
+      }
+
+      SRSharedHeader hdr;
+      memcpy(hdr.magic, kSharedMagic, sizeof(kSharedMagic));
+      hdr.keyLen = key.size();
+      hdr.begin = fBegin;
+      hdr.end = fEnd;
+      hdr.nVals = vals.size();
+
+      const size_t keyBytes = (key.size()+7)/8*8;
+      fLocal.assign(sizeof(hdr) + keyBytes + offsets.size()*sizeof(uint64_t) + vals.size()*sizeof(U), 0);
+      char* pos = fLocal.data();
+      memcpy(pos, &hdr, sizeof(hdr)); pos += sizeof(hdr);
+      memcpy(pos, key.data(), key.size()); pos += keyBytes;
+      memcpy(pos, offsets.data(), offsets.size()*sizeof(uint64_t)); pos += offsets.size()*sizeof(uint64_t);
+      // Not memcpy(), since std::vector<bool> has no data()
+      std::copy(vals.begin(), vals.end(), (U*)pos);
+      SetPointers(fLocal.data());
+
+      Publish(path);
+    }
+
+    /// Map a file published by any job. Returns false if it doesn't exist
+    /// or isn't the right cluster
+    bool Map(const std::string& path, const std::string& key)
+    {
+      const int fd = open(path.c_str(), O_RDONLY);
+      if(fd < 0) return false;
+
+      struct stat st;
+      if(fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(SRSharedHeader)){
+        close(fd);
+        return false;
+      }
+
+      void* data = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      // Mark it as recently used, for Trim()
+      if(data != MAP_FAILED) futimens(fd, 0);
+      close(fd); // the mapping keeps the file alive, even once evicted
+      if(data == MAP_FAILED) return false;
+
+      fMap = (const char*)data;
+      fMapSize = st.st_size;
+
+      // A hash collision, or a file from some other version
+      const SRSharedHeader* hdr = (const SRSharedHeader*)fMap;
+      const size_t keyBytes = (key.size()+7)/8*8;
+      const size_t expect = sizeof(SRSharedHeader) + keyBytes + (fEnd-fBegin+1)*sizeof(uint64_t) + hdr->nVals*sizeof(U);
+      if(memcmp(hdr->magic, kSharedMagic, sizeof(kSharedMagic)) != 0 ||
+         hdr->keyLen != key.size() || hdr->begin != fBegin || hdr->end != fEnd ||
+         fMapSize != expect ||
+         memcmp(fMap+sizeof(SRSharedHeader), key.data(), key.size()) != 0){
+        Unmap();
+        return false;
+      }
+
+      SetPointers(fMap);
+      return true;
+    }
+
+    /// Make fLocal available to other jobs. Failure only costs them the
+    /// decoding
+    void Publish(const std::string& path)
+    {
+      // Unique between the threads of one job, as well as between jobs
+      std::string tmp = path + ".tmpXXXXXX";
+      const int fd = mkstemp(tmp.data());
+      if(fd < 0) return;
+
+      size_t done = 0;
+      while(done < fLocal.size()){
+        const ssize_t n = write(fd, fLocal.data()+done, fLocal.size()-done);
+        if(n <= 0) break;
+        done += n;
+      }
+      close(fd);
+
+      // If another job got there first, this replaces an identical file
+      if(done != fLocal.size() || rename(tmp.c_str(), path.c_str()) != 0){
+        unlink(tmp.c_str());
+        return;
+      }
+
+      SRSharedCache::Published(fLocal.size());
+    }
+
+    void SetPointers(const char* data)
+    {
+      const SRSharedHeader* hdr = (const SRSharedHeader*)data;
+      fOffsets = (const uint64_t*)(data + sizeof(SRSharedHeader) + (hdr->keyLen+7)/8*8);
+      fVals = (const U*)(fOffsets + (fEnd-fBegin+1));
+    }
+
+    void Unmap()
+    {
+      if(fMap) munmap((void*)fMap, fMapSize);
+      fMap = 0;
+      fMapSize = 0;
+      std::vector<char>().swap(fLocal);
+      fOffsets = 0;
+      fVals = 0;
+    }
+
+    TTree* fTree;
+    const TFile* fFile;
+    long long fBegin, fEnd;
+
+    const char* fMap; ///< Mapped from the cache directory, or
+    size_t fMapSize;
+    std::vector<char> fLocal; ///< decoded by this job
+
+    const uint64_t* fOffsets;
+    const U* fVals;
+  };
+
+  //----------------------------------------------------------------------
+  void SRSharedCache::Init()
+  {
+    if(fgInit) return;
+    fgInit = true;
+
+    if(const char* mb = getenv("SRPROXY_SHARED_CACHE_MB")){
+      SetMaxBytes(size_t(atof(mb)*1024*1024));
+    }
+  }
+
+  //----------------------------------------------------------------------
+  void SRSharedCache::SetMaxBytes(size_t maxBytes, const std::string& dir)
+  {
+    fgInit = true;
+    fgMaxBytes = maxBytes;
+    fgDir = dir.empty() ? "/dev/shm/srproxy."+std::to_string(getuid()) : dir;
+    if(fgMaxBytes == 0) return;
+
+    if(mkdir(fgDir.c_str(), 0700) != 0 && errno != EEXIST){
+      std::cout << "SRSharedCache: unable to create '" << fgDir
+                << "'. Disabling." << std::endl;
+      fgMaxBytes = 0;
+      return;
+    }
+
+    // Anyone could have created it first, and planted files for us to map
+    struct stat st;
+    if(lstat(fgDir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode) ||
+       st.st_uid != getuid() || (st.st_mode & 077) != 0){
+      std::cout << "SRSharedCache: '" << fgDir << "' is not a directory private"
+                << " to this user. Disabling." << std::endl;
+      fgMaxBytes = 0;
+    }
+  }
+
+  //----------------------------------------------------------------------
+  size_t SRSharedCache::GetMaxBytes()
+  {
+    Init();
+    return fgMaxBytes;
+  }
+
+  //----------------------------------------------------------------------
+  std::string SRSharedCache::GetDirectory()
+  {
+    Init();
+    return fgDir;
+  }
+
+  //----------------------------------------------------------------------
+  void SRSharedCache::clear()
+  {
+    if(GetMaxBytes() == 0) return;
+
+    DIR* d = opendir(fgDir.c_str());
+    if(!d) return;
+    while(dirent* ent = readdir(d)){
+      if(ent->d_name[0] == '.') continue;
+      unlink((fgDir+"/"+ent->d_name).c_str());
+    }
+    closedir(d);
+  }
+
+  //----------------------------------------------------------------------
+  void SRSharedCache::Published(size_t bytes)
+  {
+    // Scanning the whole directory after every cluster would be too slow
+    fgBytesSinceTrim += bytes;
+    if(fgBytesSinceTrim > fgMaxBytes/16){
+      fgBytesSinceTrim = 0;
+      Trim();
+    }
+  }
+
+  //----------------------------------------------------------------------
+  void SRSharedCache::Trim()
+  {
+    DIR* d = opendir(fgDir.c_str());
+    if(!d) return;
+
+    // Last use and size of each published file
+    std::vector<std::tuple<timespec, size_t, std::string>> files;
+    size_t total = 0;
+    while(dirent* ent = readdir(d)){
+      if(ent->d_name[0] == '.') continue;
+      const std::string path = fgDir+"/"+ent->d_name;
+      struct stat st;
+      if(stat(path.c_str(), &st) != 0) continue; // evicted by someone else
+      files.emplace_back(st.st_mtim, st.st_size, path);
+      total += st.st_size;
+    }
+    closedir(d);
+
+    if(total <= fgMaxBytes) return;
+
+    std::sort(files.begin(), files.end(), [](const auto& a, const auto& b){
+        const timespec& ta = std::get<0>(a);
+        const timespec& tb = std::get<0>(b);
+        return std::tie(ta.tv_sec, ta.tv_nsec) < std::tie(tb.tv_sec, tb.tv_nsec);
+      });
+
+    // Other jobs may be trimming at the same time, in which case unlink()
+    // fails harmlessly
+    for(const auto& f: files){
+      if(total <= fgMaxBytes) break;
+      unlink(std::get<2>(f).c_str());
+      total -= std::get<1>(f);
+    }
+  }
+
+  //----------------------------------------------------------------------
+  template<class U> std::shared_ptr<SRSharedColumn<U>>
+  SRSharedCache::GetColumn(TTree* tr, const std::string& branch)
+  {
+    if constexpr(std::is_same_v<U, std::string>){
+      return 0;
+    }
+    else{
+      if(GetMaxBytes() == 0) return 0;
+
+      // In-memory trees can't be shared
+      if(!tr->GetCurrentFile()) return 0;
+
+      // All the proxies of one branch share their cluster
+      return GetShared<SRSharedColumn<U>>(tr, branch, [](){return std::make_shared<SRSharedColumn<U>>();});
+    }
+  }
+
   //----------------------------------------------------------------------
   CAFType GetCAFType(TTree* tr)
   {
     if(!tr) return kCopiedRecord;
 
+    if(dynamic_cast<SRMappedTree*>(tr)) return kMapped;
+    if(dynamic_cast<SRNTupleTreeBase*>(tr)) return kNTuple;
+
     // Allow user to override automatic CAF type detection if necessary
     const char* alias = tr->GetAlias("srproxy_metadata_caftype_override");
     if(alias){
@@ -159,6 +802,204 @@ namespace caf
     return kNested;
   }
 
+  //----------------------------------------------------------------------
+  void EnablePrefetch(TTree* tr, long long cacheBytes, bool parallelUnzip)
+  {
+    // The choice of TTreeCacheUnzip is global, and made as each cache is
+    // created. Only ours should see it, so put it back as it was after
+    struct RestoreUnzip
+    {
+      bool was;
+      ~RestoreUnzip(){TTreeCacheUnzip::SetParallelUnzip(was ? TTreeCacheUnzip::kEnable : TTreeCacheUnzip::kDisable);}
+    } restore{TTreeCacheUnzip::IsParallelUnzip()};
+
+    if(parallelUnzip){
+      // Turning on IMT affects everything else ROOT does, so is left to the
+      // caller
+      if(!ROOT::IsImplicitMTEnabled()){
+        std::cout << "EnablePrefetch: parallel unzipping needs ROOT::EnableImplicitMT() to have been called first" << std::endl;
+        abort();
+      }
+      TTreeCacheUnzip::SetParallelUnzip(TTreeCacheUnzip::kEnable);
+    }
+
+    // Branches may be in friend trees (e.g. split files), which each need
+    // their own cache
+    std::set<TTree*> trees = {tr};
+    tr->SetCacheSize(cacheBytes);
+
+    const std::set<std::string>& branches = SRBranchRegistry::GetBranches();
+    if(branches.empty()){
+      // Let ROOT learn which branches are used
+    }
+    else if(IsFlatLayout(GetCAFType(tr))){
+      for(const std::string& b: SRBranchRegistry::WithIndexFields(branches)){
+        // Not all prefixes are really vectors
+        TBranch* br = tr->GetBranch(b.c_str());
+        if(!br) continue;
+
+        TTree* owner = br->GetTree();
+        if(owner != tr && trees.insert(owner).second) owner->SetCacheSize(cacheBytes);
+        owner->AddBranchToCache(b.c_str());
+      }
+    }
+    else{
+      // The registry holds formulae, not branch names. Cache everything that
+      // is enabled.
+      tr->AddBranchToCache("*", true);
+    }
+
+    for(TTree* t: trees){
+      if(!branches.empty()) t->StopCacheLearningPhase();
+
+      // Fill the cache with as many clusters as fit in cacheBytes, rather
+      // than only the current one...
+      t->SetClusterPrefetch(true);
+
+      // ...and read those blocks on ROOT's prefetching thread, while the
+      // entries already in memory are processed
+      TTreeCache* cache = t->GetReadCache(t->GetCurrentFile());
+      if(cache) cache->SetEnablePrefetching(true);
+    }
+  }
+
+  //----------------------------------------------------------------------
+  void AddFlatFriends(TTree* tr, const std::vector<std::string>& fnames,
+                      const std::string& treeName)
+  {
+    const std::string tname = treeName.empty() ? tr->GetName() : treeName;
+
+    for(const std::string& fname: fnames){
+      // Added by name, the friend opens the file itself, and closes it when
+      // it is removed, or tr deleted
+      TFriendElement* fe = tr->AddFriend(tname.c_str(), fname.c_str());
+      TTree* fr = fe ? fe->GetTree() : 0;
+      if(!fr){
+        std::cout << "AddFlatFriends: no tree '" << tname << "' in '" << fname << "'" << std::endl;
+        abort();
+      }
+
+      // Friends are matched up by entry number
+      if(fr->GetEntries() != tr->GetEntries()){
+        std::cout << "AddFlatFriends: '" << fname << "' has " << fr->GetEntries()
+                  << " entries, but '" << tr->GetName() << "' has "
+                  << tr->GetEntries() << std::endl;
+        abort();
+      }
+    }
+  }
+
+  //----------------------------------------------------------------------
+  std::vector<SRShard> MakeShards(const std::vector<std::string>& fnames,
+                                  int nShards,
+                                  const std::string& treeName,
+                                  const std::set<std::string>& branches)
+  {
+    if(nShards <= 0){
+      std::cout << "MakeShards: nShards must be positive, not " << nShards << std::endl;
+      abort();
+    }
+
+    struct Cluster
+    {
+      int file;
+      long long begin, end;
+      long long bytes;
+    };
+    std::vector<Cluster> clusters;
+
+    for(unsigned int fileIdx = 0; fileIdx < fnames.size(); ++fileIdx){
+      TFile* f = TFile::Open(fnames[fileIdx].c_str());
+      TTree* tr = 0;
+      if(f && !f->IsZombie()) f->GetObject(treeName.c_str(), tr);
+      if(!tr){
+        std::cout << "MakeShards: no tree '" << treeName << "' in '" << fnames[fileIdx] << "'" << std::endl;
+        abort();
+      }
+
+      const long long N = tr->GetEntries();
+
+      const unsigned int first = clusters.size();
+      std::vector<long long> starts;
+      TTree::TClusterIterator it = tr->GetClusterIterator(0);
+      for(long long start = it.Next(); start < N; start = it.Next()){
+        starts.push_back(start);
+        // Weight every cluster a little, so that shards are never all empty
+        clusters.push_back({int(fileIdx), start, it.GetNextEntry(), 1});
+      }
+
+      // Which branches will be read
+      std::vector<TBranch*> active;
+      if(branches.empty() || !IsFlatLayout(GetCAFType(tr))){
+        TObjArray* leaves = tr->GetListOfLeaves();
+        for(int i = 0; i < leaves->GetEntriesFast(); ++i){
+          active.push_back(((TLeaf*)leaves->UncheckedAt(i))->GetBranch());
+        }
+        // Branches with several leaves only count once
+        std::sort(active.begin(), active.end());
+        active.erase(std::unique(active.begin(), active.end()), active.end());
+      }
+      else{
+        for(const std::string& b: SRBranchRegistry::WithIndexFields(branches)){
+          TBranch* br = tr->GetBranch(b.c_str());
+          if(br) active.push_back(br);
+        }
+      }
+
+      // Assign each basket to the cluster it starts in
+      for(TBranch* br: active){
+        const long long* basketEntry = br->GetBasketEntry();
+        const int* basketBytes = br->GetBasketBytes();
+        for(int b = 0; b < br->GetWriteBasket(); ++b){
+          const auto c = std::upper_bound(starts.begin(), starts.end(), basketEntry[b]);
+          if(c == starts.begin()) continue;
+          clusters[first + (c-starts.begin()) - 1].bytes += basketBytes[b];
+        }
+      }
+
+      delete f;
+    }
+
+    long long total = 0;
+    for(const Cluster& c: clusters) total += c.bytes;
+
+    std::vector<SRShard> ret(nShards);
+    for(SRShard& s: ret) s.bytes = 0;
+
+    // Cut the sequence of clusters where the running total passes each
+    // multiple of total/nShards
+    long long sofar = 0;
+    for(const Cluster& c: clusters){
+      const int shard = std::min<long long>(nShards-1, (sofar + c.bytes/2)*nShards/std::max(total, 1LL));
+      sofar += c.bytes;
+
+      SRShard& s = ret[shard];
+      s.bytes += c.bytes;
+      if(!s.ranges.empty() && s.ranges.back().file == fnames[c.file] && s.ranges.back().end == c.begin){
+        s.ranges.back().end = c.end;
+      }
+      else{
+        s.ranges.push_back({fnames[c.file], c.begin, c.end});
+      }
+    }
+
+    return ret;
+  }
+
+  //----------------------------------------------------------------------
+  void SetShardRange(TTree* tr, const SRShardRange& r)
+  {
+    tr->SetCacheEntryRange(r.begin, r.end);
+
+    // Split files (see AddFlatFriends()) have a cache per part
+    TList* friends = tr->GetListOfFriends();
+    if(!friends) return;
+    for(TObject* obj: *friends){
+      TTree* fr = ((TFriendElement*)obj)->GetTree();
+      if(fr) fr->SetCacheEntryRange(r.begin, r.end);
+    }
+  }
+
   //----------------------------------------------------------------------
   std::string StripSubscripts(const std::string& s)
   {
@@ -181,11 +1022,11 @@ namespace caf
 
   //----------------------------------------------------------------------
   template<class T>
-  Proxy<T>::Proxy(TTree *tr, const std::string &name, const long &base, int offset, const Lineage *parent)
+  Proxy<T>::Proxy(TTree *tr, const std::string &name, const long &base, int offset, const Lineage *parent, ColumnID col)
     : Lineage(parent),
       fName(name), fType(GetCAFType(tr)),
-      fLeaf(0), fTree(tr),
-      fBase(base), fOffset(offset),
+      fLeaf(0), fTree(tr), fStamp(0),
+      fBase(base), fOffset(offset), fCol(col), fValPos(-1), fFriend(false), fMapped(0), fNTuple(0), fBoundPtr(0),
       fLeafInfo(0), fBranch(0), fTTF(0), fEntry(-1), fSubIdx(0)
   {
   }
@@ -195,8 +1036,8 @@ namespace caf
   //----------------------------------------------------------------------
   template<class T> Proxy<T>::Proxy(const Proxy<T>& p)
     : Lineage(&p), fName("copy of "+p.fName), fType(kCopiedRecord),
-      fLeaf(0), fTree(0),
-      fBase(kDummyBaseUninit), fOffset(-1),
+      fLeaf(0), fTree(0), fStamp(0),
+      fBase(kDummyBaseUninit), fOffset(-1), fCol(kNoColumn), fValPos(-1), fFriend(false), fMapped(0), fNTuple(0), fBoundPtr(0),
       fLeafInfo(0), fBranch(0), fTTF(0), fEntry(-1), fSubIdx(-1)
   {
     // Ensure that the value is evaluated and baked in in the parent object, so
@@ -208,8 +1049,8 @@ namespace caf
   template<class T> Proxy<T>::Proxy(const Proxy&& p)
     : Lineage(std::move(p)),
       fName("move of "+p.fName), fType(kCopiedRecord),
-      fLeaf(0), fTree(0),
-      fBase(kDummyBaseUninit), fOffset(-1),
+      fLeaf(0), fTree(0), fStamp(0),
+      fBase(kDummyBaseUninit), fOffset(-1), fCol(kNoColumn), fValPos(-1), fFriend(false), fMapped(0), fNTuple(0), fBoundPtr(0),
       fLeafInfo(0), fBranch(0), fTTF(0), fEntry(-1), fSubIdx(-1)
   {
     // Ensure that the value is evaluated and baked in in the parent object, so
@@ -227,10 +1068,33 @@ namespace caf
   //----------------------------------------------------------------------
   template<class T> T Proxy<T>::GetValue() const
   {
+    // Copies are temporaries, and their values come from the originals,
+    // which were recorded when they were copied
+    if(SRDependencyTracker::Recording() && &fBase != &kDummyBaseUninit){
+      SRDependencyTracker::Add({&VersionOf, this, Version()});
+    }
+
     switch(fType){
     case kNested: return GetValueNested();
     case kFlat: return GetValueFlat();
+    case kMapped:
+    case kNTuple: return GetValueColumnar();
     case kCopiedRecord: return (T)fVal;
+    case kBound: return (fEntry == SRBoundRecord::Event()) ? (T)fVal : *fBoundPtr;
+    default: abort();
+    }
+  }
+
+  //----------------------------------------------------------------------
+  template<class T> SRVersion Proxy<T>::Version() const
+  {
+    switch(fType){
+    case kNested:
+    case kFlat:
+    case kMapped:
+    case kNTuple: return {fTree->GetReadEntry(), fBase+fOffset, fStamp};
+    case kCopiedRecord: return {0, 0, fStamp};
+    case kBound: return {SRBoundRecord::Event(), long(fBoundPtr), fStamp};
     default: abort();
     }
   }
@@ -251,33 +1115,23 @@ namespace caf
     return val;
   }
 
-  //----------------------------------------------------------------------
-  template<class T> void GetTypedValueWrapper(TLeaf* leaf, T& x, int subidx)
-  {
-    x = leaf->GetTypedValue<T>(subidx);
-  }
-
-  //----------------------------------------------------------------------
-  void GetTypedValueWrapper(TLeaf* leaf, std::string& x, int subidx)
-  {
-    assert(subidx == 0); // Unused for flat trees at least
-    x = (char*)leaf->GetValuePointer();
-  }
-
   //----------------------------------------------------------------------
   template<class T> T Proxy<T>::GetValueFlat() const
   {
     assert(fTree);
 
     // Valid cached or systematically-shifted value
-    if(fEntry == fTree->GetReadEntry()) return (T)fVal;
+    const long pos = fBase+fOffset;
+    if(fEntry == fTree->GetReadEntry() && fValPos == pos) return (T)fVal;
     fEntry = fTree->GetReadEntry();
+    fValPos = pos;
 
     if(!fLeaf){
       const std::string sname = StripSubscripts(fName);
       // In a flat tree the branch and leaf have the same name, and this is
-      // quicker than the naive TTree::GetLeaf()
-      fBranch = fTree->GetBranch(sname.c_str());
+      // quicker than the naive TTree::GetLeaf(). Looking up by column ID
+      // avoids searching the tree for every proxy.
+      fBranch = SRColumnTable::GetBranch(fTree, fCol, sname);
       fLeaf = fBranch ? fBranch->GetLeaf(sname.c_str()) : 0;
 
       if(!fLeaf){
@@ -291,11 +1145,78 @@ namespace caf
          fName.find("..length") == std::string::npos){
         SRBranchRegistry::AddBranch(sname);
       }
+
+      // From the other part of a split file
+      fFriend = fBranch->GetTree() != fTree;
+
+      // The cache is indexed by entries of fTree, which only line up with
+      // those of a friend if it is a plain tree
+      if(!fFriend || fBranch->GetTree()->GetEntries() == fTree->GetEntries())
+        fCached = SRColumnCache::GetColumn<U>(fTree, sname);
+
+      // Otherwise, other jobs on the node may have decoded it already
+      if(!fCached) fShm = SRSharedCache::GetColumn<U>(fTree, sname);
     }
 
-    fBranch->GetEntry(fEntry);
+    if(fCached){
+      // Served from memory on later passes, recorded on the first one
+      if(fCached->Get(fEntry, pos, fVal)) return (T)fVal;
+      if(!fCached->Fill(fBranch, fLeaf, fEntry)) fCached = 0;
+      if(fBranch->GetReadEntry() != fEntry) fBranch->GetEntry(fEntry);
+    }
+    else if(fShm && fShm->Get(fBranch, fLeaf, pos, fVal)){
+      return (T)fVal;
+    }
+    else if(fFriend){
+      // Friend trees are positioned by the main tree, but a chain of them
+      // need not number its entries the same way
+      fBranch->GetEntry(fBranch->GetTree()->GetReadEntry());
+    }
+    else{
+      fBranch->GetEntry(fEntry);
+    }
 
-    GetTypedValueWrapper(fLeaf, fVal, fBase+fOffset);
+    GetTypedValueWrapper(fLeaf, fVal, pos);
+
+    return (T)fVal;
+  }
+
+  //----------------------------------------------------------------------
+  template<class T> T Proxy<T>::GetValueColumnar() const
+  {
+    assert(fTree);
+
+    // Valid cached or systematically-shifted value
+    const long pos = fBase+fOffset;
+    if(fEntry == fTree->GetReadEntry() && fValPos == pos) return (T)fVal;
+    fEntry = fTree->GetReadEntry();
+    fValPos = pos;
+
+    if(!fMapped && !fNTuple){
+      const std::string sname = StripSubscripts(fName);
+      if(fType == kMapped)
+        fMapped = ((SRMappedTree*)fTree)->GetColumn(sname);
+      else
+        fNTuple = ((SRNTupleTreeBase*)fTree)->GetColumn(sname);
+
+      if(!fMapped && !fNTuple){
+        std::cout << std::endl << "BasicTypeProxy: Column '" << sname
+                  << "' not found in file '" << fTree->GetTitle()
+                  << "'." << std::endl;
+        abort();
+      }
+
+      if(fName.find("..idx") == std::string::npos &&
+         fName.find("..length") == std::string::npos){
+        SRBranchRegistry::AddBranch(sname);
+      }
+    }
+
+    const bool ok = fMapped ? fMapped->Get(fEntry, pos, fVal) : fNTuple->Get(fEntry, pos, fVal);
+    if(!ok){
+      std::cout << std::endl << fName << " out of range in '" << fTree->GetTitle() << "'. Aborting." << std::endl;
+      abort();
+    }
 
     return (T)fVal;
   }
@@ -311,6 +1232,83 @@ namespace caf
     x = ttf->EvalStringInstance(0);
   }
 
+  //----------------------------------------------------------------------
+  /// \brief One formula for a leaf of all the elements of a nested vector
+  ///
+  /// rec.slc[0].energy, rec.slc[1].energy etc all share rec.slc.energy,
+  /// which is compiled once, and sized once per entry. Each element then
+  /// evaluates only its own instance.
+  class SRSharedFormula
+  {
+  public:
+    SRSharedFormula(TTree* tr, const std::string& name)
+      : fTTF(new TTreeFormula(("TTFShared-"+name).c_str(), name.c_str(), tr)),
+        fEntry(-1), fN(0)
+    {
+      fLeafInfo = fTTF->GetLeafInfo(0);
+      fLeaf = fTTF->GetLeaf(0);
+      fBranch = fLeaf ? fLeaf->GetBranch() : 0;
+
+      if(!fLeaf || !fBranch){
+        std::cout << "Couldn't find " << name << " in tree. Abort."
+                  << std::endl;
+        abort();
+      }
+    }
+
+    ~SRSharedFormula(){delete fTTF;}
+
+    /// Formula for \a name in \a tr, shared with any other users
+    static std::shared_ptr<SRSharedFormula> Get(TTree* tr, const std::string& name)
+    {
+      return GetShared<SRSharedFormula>(tr, name, [&](){return std::make_shared<SRSharedFormula>(tr, name);});
+    }
+
+    /// Number of elements in \a entry
+    int Size(long entry)
+    {
+      if(entry == fEntry) return fN;
+      fEntry = entry;
+
+      if(fLeafInfo){
+        fN = fTTF->GetNdata();
+        // Reads the branches, as TTree::Draw() would
+        if(fN > 0) fTTF->EvalInstance(0);
+      }
+      else{
+        if(fBranch->GetReadEntry() != entry) fBranch->GetEntry(entry);
+        fN = fLeaf->GetLen();
+      }
+      return fN;
+    }
+
+    /// Must follow Size() for the same entry
+    template<class U> void Eval(int i, U& x) const
+    {
+      if(fLeafInfo)
+        x = (U)fTTF->EvalInstance(i);
+      else
+        GetTypedValueWrapper(fLeaf, x, i);
+    }
+
+    void Eval(int i, std::string& x) const
+    {
+      if(fLeafInfo)
+        x = fTTF->EvalStringInstance(i);
+      else
+        GetTypedValueWrapper(fLeaf, x, i);
+    }
+
+  protected:
+    TTreeFormula* fTTF;
+    TFormLeafInfo* fLeafInfo;
+    TLeaf* fLeaf;
+    TBranch* fBranch;
+
+    long fEntry;
+    int fN;
+  };
+
   //----------------------------------------------------------------------
   template<class T> T Proxy<T>::GetValueNested() const
   {
@@ -321,9 +1319,33 @@ namespace caf
     fEntry = fTree->GetReadEntry();
 
     // First time calling, set up the branches etc
-    if(!fTTF){
+    if(!fTTF && !fShared){
       SRBranchRegistry::AddBranch(fName);
 
+      // A single plain subscript, e.g. rec.slc[3].energy, can share a
+      // formula with the other elements
+      const size_t open_idx = fName.find('[');
+      if constexpr(!std::is_same_v<T, std::string>){
+        if(open_idx != std::string::npos && open_idx == fName.rfind('[') &&
+           fName.find('@') == std::string::npos){
+          fShared = SRSharedFormula::Get(fTree, StripSubscripts(fName));
+          fSubIdx = atoi(fName.c_str()+open_idx+1);
+        }
+      }
+    }
+
+    if(fShared){
+      const int n = fShared->Size(fEntry);
+      if(fSubIdx >= n){
+        std::cout << std::endl << fName << " out of range (size() == " << n << "). Aborting." << std::endl;
+        abort();
+      }
+      fShared->Eval(fSubIdx, fVal);
+      return (T)fVal;
+    }
+
+    if(!fTTF){
+
       // Leaves are attached to the TTF, must keep it
       fTTF = new TTreeFormula(("TTFProxy-"+fName).c_str(), fName.c_str(), fTree);
       fLeafInfo = fTTF->GetLeafInfo(0); // Can fail (for a regular branch?)
@@ -366,7 +1388,7 @@ namespace caf
       // This check is much quicker than what CheckIndex() does, which winds up
       // calling a TTF, but I can't figure out a safe way to automatically
       // elide that check.
-      if(fSubIdx > fLeaf->GetLen()){
+      if(fSubIdx >= fLeaf->GetLen()){
         std::cout << std::endl << fName << " out of range (" << fName << ".size() == " << fLeaf->GetLen() << "). Aborting." << std::endl;
         abort();
       }
@@ -382,14 +1404,23 @@ namespace caf
   {
     if(SRProxySystController::InTransaction()) SRProxySystController::Backup(*this);
     fVal = x;
+    fStamp = SRDependencyTracker::NextStamp();
 
     switch(fType){
     case kNested: fEntry = fTree->GetReadEntry(); break;
-    case kFlat:   fEntry = fTree->GetReadEntry(); break;
+    case kFlat:   fEntry = fTree->GetReadEntry(); fValPos = fBase+fOffset; break;
+    case kMapped:
+    case kNTuple: fEntry = fTree->GetReadEntry(); fValPos = fBase+fOffset; break;
     case kCopiedRecord: break;
+    case kBound: fEntry = SRBoundRecord::Event(); break;
     default: abort();
     }
 
+    // Shifts are already visible through AnyShifted()
+    if(IsFlatLayout(fType) && !SRProxySystController::InTransaction()){
+      VectorProxyBase::NoteAssigned(fTree, fEntry);
+    }
+
     return *this;
   }
 
@@ -467,12 +1498,13 @@ namespace caf
                                              const std::string& name,
                                              bool isNestedContainer,
                                              const long& base, int offset,
-                                             const Lineage * parent)
+                                             const Lineage * parent,
+                                             ColumnID col)
     : Lineage(parent),
       fTree(tr),
       fName(name), fIsNestedContainer(isNestedContainer),
       fType(GetCAFType(tr)),
-      fBase(base), fOffset(offset),
+      fBase(base), fOffset(offset), fCol(col),
       fIdxP(0), fIdx(0)
   {
   }
@@ -483,18 +1515,126 @@ namespace caf
     delete fIdxP;
   }
 
+  //----------------------------------------------------------------------
+  /// \brief Rebuilds a ..idx field from the ..length field it sums
+  ///
+  /// Shared by all the proxies of one field, and computed once per entry
+  class SRPrefixSum
+  {
+  public:
+    SRPrefixSum(TTree* tr, const std::string& lengthField)
+      : fTree(tr), fMapped(0), fNTuple(0), fBranch(0), fLeaf(0), fEntry(-1)
+    {
+      if(dynamic_cast<SRMappedTree*>(tr)){
+        fMapped = ((SRMappedTree*)tr)->GetColumn(lengthField);
+      }
+      else if(dynamic_cast<SRNTupleTreeBase*>(tr)){
+        fNTuple = ((SRNTupleTreeBase*)tr)->GetColumn(lengthField);
+      }
+      else{
+        fBranch = tr->GetBranch(lengthField.c_str());
+        fLeaf = fBranch ? fBranch->GetLeaf(lengthField.c_str()) : 0;
+      }
+
+      if(!fMapped && !fNTuple && !fLeaf){
+        std::cout << std::endl << "BasicTypeProxy: neither an index nor '"
+                  << lengthField << "' found in tree '" << tr->GetName()
+                  << "'." << std::endl;
+        abort();
+      }
+    }
+
+    /// Shared with any other users of the same field
+    static std::shared_ptr<SRPrefixSum> Get(TTree* tr, const std::string& lengthField)
+    {
+      return GetShared<SRPrefixSum>(tr, lengthField, [&](){return std::make_shared<SRPrefixSum>(tr, lengthField);});
+    }
+
+    long At(long pos)
+    {
+      const long long entry = fTree->GetReadEntry();
+      if(entry != fEntry) Compute(entry);
+
+      if(pos < 0 || pos >= (long)fIdx.size()){
+        std::cout << std::endl << "BasicTypeProxy: index position " << pos
+                  << " out of range (" << fIdx.size() << ") in entry "
+                  << entry << std::endl;
+        abort();
+      }
+      return fIdx[pos];
+    }
+
+  protected:
+    void Compute(long long entry)
+    {
+      fEntry = entry;
+      fIdx.clear();
+
+      long sum = 0;
+      if(fMapped || fNTuple){
+        int len;
+        for(int i = 0; fMapped ? fMapped->Get(entry, i, len) : fNTuple->Get(entry, i, len); ++i){
+          fIdx.push_back(sum);
+          sum += len;
+        }
+      }
+      else{
+        // May be in a friend tree
+        fBranch->GetEntry(fBranch->GetTree()->GetReadEntry());
+        const int n = fLeaf->GetLen();
+        for(int i = 0; i < n; ++i){
+          fIdx.push_back(sum);
+          sum += fLeaf->GetTypedValue<long>(i);
+        }
+      }
+    }
+
+    TTree* fTree;
+    const SRMappedColumn* fMapped;
+    const SRNTupleColumn* fNTuple;
+    TBranch* fBranch;
+    TLeaf* fLeaf;
+
+    long long fEntry;
+    std::vector<long> fIdx;
+  };
+
   //----------------------------------------------------------------------
   void ArrayVectorProxyBase::EnsureIdxP() const
   {
-    if(fIdxP) return;
+    if(fIdxP || fPrefix) return;
 
     // Only used for flat trees. For single-tree, only needed for objects not
     // at top-level.
-    if(fType == kFlat && NSubscripts(fName) > 0){
-      fIdxP = new Proxy<long long>(fTree, IndexField(), fBase, fOffset, nullptr);
+    if(IsFlatLayout(fType) && NSubscripts(fName) > 0){
+      const std::string lengthField = IdxLengthField();
+
+      bool hasIdx = true;
+      if(!lengthField.empty()){
+        if(fType == kMapped)
+          hasIdx = ((SRMappedTree*)fTree)->GetColumn(StripSubscripts(IndexField()));
+        else if(fType == kNTuple)
+          hasIdx = ((SRNTupleTreeBase*)fTree)->GetColumn(StripSubscripts(IndexField()));
+        else
+          hasIdx = SRColumnTable::GetBranch(fTree, IndexColumn(), StripSubscripts(IndexField()));
+      }
+
+      if(hasIdx){
+        fIdxP = new Proxy<long long>(fTree, IndexField(), fBase, fOffset, nullptr, IndexColumn());
+      }
+      else{
+        // Written with IBranchPolicy::DeriveIndices()
+        fPrefix = SRPrefixSum::Get(fTree, StripSubscripts(lengthField));
+      }
     }
   }
 
+  //----------------------------------------------------------------------
+  long ArrayVectorProxyBase::PrefixIdx() const
+  {
+    return fPrefix->At(fBase+fOffset);
+  }
+
   //----------------------------------------------------------------------
   void ArrayVectorProxyBase::CheckIndex(size_t i, size_t size) const
   {
@@ -524,7 +1664,7 @@ namespace caf
   //----------------------------------------------------------------------
   std::string VectorProxyBase::LengthField() const
   {
-    if(fType == kFlat) return fName+"..length";
+    if(IsFlatLayout(fType)) return fName+"..length";
 
     // Counts exist, but with non-systematic names
     if(fName == "rec.me.trkkalman"  ) return "rec.me.nkalman";
@@ -572,10 +1712,16 @@ namespace caf
   //----------------------------------------------------------------------
   std::string ArrayVectorProxyBase::IndexField() const
   {
-    if(fType == kFlat) return fName+"..idx";
+    if(IsFlatLayout(fType)) return fName+"..idx";
     abort();
   }
 
+  //----------------------------------------------------------------------
+  ColumnID ArrayVectorProxyBase::IndexColumn() const
+  {
+    return SubColumn(fCol, 0);
+  }
+
   //----------------------------------------------------------------------
   std::string ArrayVectorProxyBase::Subscript(int i) const
   {
@@ -595,7 +1741,7 @@ namespace caf
   {
     // Nested containers would have the same name for length and idx at each
     // level, which is bad, so their names are uniquified.
-    if(fType == kFlat && fIsNestedContainer)
+    if(IsFlatLayout(fType) && fIsNestedContainer)
       return fName+".elems";
     else
       return fName;
@@ -605,6 +1751,8 @@ namespace caf
   bool ArrayVectorProxyBase::TreeHasLeaf(TTree* tr,
                                          const std::string& name) const
   {
+    if(fType == kMapped) return ((SRMappedTree*)tr)->GetColumn(name);
+    if(fType == kNTuple) return ((SRNTupleTreeBase*)tr)->GetColumn(name);
     return tr->GetLeaf(name.c_str());
   }
 
@@ -613,8 +1761,9 @@ namespace caf
                                    const std::string& name,
                                    bool isNestedContainer,
                                    const long& base, int offset,
-                                   const Lineage * parent)
-    : ArrayVectorProxyBase(tr, name, isNestedContainer, base, offset, parent),
+                                   const Lineage * parent,
+                                   ColumnID col)
+    : ArrayVectorProxyBase(tr, name, isNestedContainer, base, offset, parent, col),
       fSize(0)
   {
   }
@@ -625,12 +1774,56 @@ namespace caf
     delete fSize;
   }
 
+  //----------------------------------------------------------------------
+  ColumnID VectorProxyBase::IndexColumn() const
+  {
+    // Preceded by the length field
+    return SubColumn(fCol, 1);
+  }
+
+  //----------------------------------------------------------------------
+  std::string VectorProxyBase::IdxLengthField() const
+  {
+    return LengthField();
+  }
+
+  //----------------------------------------------------------------------
+  bool VectorProxyBase::CanUseCursor() const
+  {
+    // Nested files address elements by name, and shifted or assigned values
+    // are held by the individual elements
+    if(!IsFlatLayout(fType) || SRProxySystController::AnyShifted()) return false;
+
+    // An SRMemo would record the cursor as a single dependency, whose
+    // position is that of the last element read
+    if(SRDependencyTracker::Recording()) return false;
+
+    if(fgAssigned.empty()) return true;
+    auto it = fgAssigned.find(fTree);
+    return it == fgAssigned.end() || it->second != fTree->GetReadEntry();
+  }
+
+  //----------------------------------------------------------------------
+  void VectorProxyBase::NoteAssigned(const TTree* tr, long long entry)
+  {
+    fgAssigned[tr] = entry;
+  }
+
   //----------------------------------------------------------------------
   void VectorProxyBase::EnsureSizeExists() const
   {
     if(fSize) return;
 
-    fSize = new Proxy<int>(fTree, LengthField(), fBase, fOffset, nullptr);
+    fSize = new Proxy<int>(fTree, LengthField(), fBase, fOffset, nullptr, fCol);
+  }
+
+  //----------------------------------------------------------------------
+  void VectorProxyBase::CheckSizeEquals(size_t n, size_t x) const
+  {
+    if(n != x){
+      std::cout << fName << ".size() differs: "
+                << n << " vs " << x << std::endl;
+    }
   }
 
   //----------------------------------------------------------------------
@@ -1,10 +1,15 @@
 #pragma once
 
+#include <algorithm>
 #include <array>
 #include <cassert>
 #include <cmath> // for std::isinf and std::isnan
+#include <functional>
+#include <memory>
 #include <set>
 #include <string>
+#include <tuple>
+#include <unordered_map>
 #include <vector>
 
 class TFormLeafInfo;
@@ -27,6 +32,11 @@ namespace caf
 
     static void Print(bool abbrev = true);
     static void ToFile(const std::string& fname);
+
+    /// \brief Add the ..length and ..idx fields needed to read \a branches
+    ///
+    /// These are not included in the registry itself. Applies to flat files.
+    static std::set<std::string> WithIndexFields(const std::set<std::string>& branches);
   protected:
     static std::set<std::string> fgBranches;
   };
@@ -35,11 +45,250 @@ namespace caf
   {
     kNested,
     kFlat,
-    kCopiedRecord // Assigned into, not associated with a file
+    kCopiedRecord, // Assigned into, not associated with a file
+    kMapped, // Memory-mapped columnar file, see ColumnarFile.h
+    kBound, // Reads directly from a record in memory, see BindRecord()
+    kNTuple // Flat layout stored as an RNTuple, see NTupleFile.h
   };
 
   CAFType GetCAFType(TTree* tr);
 
+  /// Does this type of file use the flat branch naming (..length, ..idx etc)?
+  inline bool IsFlatLayout(CAFType t){return t == kFlat || t == kMapped || t == kNTuple;}
+
+  /// \brief Counts the records bound with BindRecord()
+  ///
+  /// Plays the role of the entry number for bound proxies, so that
+  /// systematic shifts last until the next record is bound.
+  class SRBoundRecord
+  {
+  public:
+    static long long Event(){return fgEvent;}
+    static void NextEvent(){++fgEvent;}
+  protected:
+    static long long fgEvent;
+  };
+
+  /// \brief Read ahead the branches the proxies use
+  ///
+  /// Sets up ROOT's TTreeCache on \a tr (and on any friends holding those
+  /// branches) for the branches in SRBranchRegistry, so it doesn't need a
+  /// learning phase. If the registry is empty the cache learns from the
+  /// first entries instead. The cache is filled with as many clusters ahead
+  /// as fit in \a cacheBytes (TTree::SetClusterPrefetch()), and those are
+  /// read asynchronously, on ROOT's TFilePrefetch thread, while the current
+  /// cluster is processed. For a TChain this applies to the file currently
+  /// loaded, so call it again after moving to the next file.
+  ///
+  /// \param cacheBytes    Memory bound for the cache, including the clusters
+  ///                      read ahead. Negative means ROOT's default
+  /// \param parallelUnzip Use TTreeCacheUnzip, which decompresses the baskets
+  ///                      in the cache, including those read ahead, on ROOT's
+  ///                      implicit multi-threading pool, which the caller
+  ///                      must already have enabled. This only affects the
+  ///                      caches created here, the global setting is left as
+  ///                      it was
+  void EnablePrefetch(TTree* tr, long long cacheBytes = -1, bool parallelUnzip = false);
+
+  /// \brief Attach the other parts of a split flat CAF to \a tr
+  ///
+  /// For files written by flat::ConvertToFlat() with several outputs. The
+  /// parts are added as friends, so proxies on \a tr find their branches in
+  /// whichever part holds them. Every part must have the same entries.
+  /// \a tr owns the files, which are closed when it is deleted.
+  ///
+  /// \param treeName Name of the tree in the other files. Empty means the
+  ///                 same as \a tr
+  void AddFlatFriends(TTree* tr, const std::vector<std::string>& fnames,
+                      const std::string& treeName = "");
+
+  /// Entries [begin, end) of one file
+  struct SRShardRange
+  {
+    std::string file;
+    long long begin;
+    long long end;
+  };
+
+  /// One unit of work, as made by MakeShards()
+  struct SRShard
+  {
+    std::vector<SRShardRange> ranges; ///< In file order
+    long long bytes; ///< Compressed size of the active branches
+  };
+
+  /// \brief Split \a fnames into \a nShards contiguous pieces of work
+  ///
+  /// Shards start and end on ROOT cluster boundaries, so no basket is
+  /// decompressed by two shards, and are balanced by the compressed size of
+  /// the branches that will be read, rather than by entry count. A shard may
+  /// span several files, and may be empty if there are fewer clusters than
+  /// shards.
+  ///
+  /// \param branches The active branches, for flat files. Empty (or a nested
+  ///                 file) means all branches
+  std::vector<SRShard> MakeShards(const std::vector<std::string>& fnames,
+                                  int nShards,
+                                  const std::string& treeName = "recTree",
+                                  const std::set<std::string>& branches = SRBranchRegistry::GetBranches());
+
+  /// \brief Restrict prefetching on \a tr (and its friends) to \a r
+  ///
+  /// Call after EnablePrefetch(), then loop over r.begin to r.end, so that
+  /// the cache doesn't read clusters belonging to the next shard.
+  void SetShardRange(TTree* tr, const SRShardRange& r);
+
+  /// \brief Integer identifier of a flattened leaf path
+  ///
+  /// gen_srproxy assigns every leaf path below the top-level record an ID,
+  /// laid out so that each proxy can compute the IDs of its members by adding
+  /// a constant offset to its own.
+  typedef int ColumnID;
+  inline const ColumnID kNoColumn = -1;
+
+  /// Arrays up to this size are written inline, see flat::kMaxInlineSize,
+  /// which this must match
+  const unsigned int kMaxInlineArraySize = 16;
+
+  /// Offset a parent's column ID, propagating kNoColumn
+  inline ColumnID SubColumn(ColumnID col, int offset)
+  {
+    return (col == kNoColumn) ? kNoColumn : col+offset;
+  }
+
+  /// Table of the leaf paths corresponding to each ColumnID, and the mapping
+  /// from those to the branches of the current tree.
+  class SRColumnTable
+  {
+  public:
+    /// Called by the generated code to describe the flattened leaf paths,
+    /// relative to the top-level record
+    static void SetPaths(const char* const* paths, int n);
+
+    static int NColumns(){return Paths().size();}
+    /// Path of column \a id, relative to the top-level record
+    static const char* Path(ColumnID id);
+    /// Reverse lookup, for tools. Returns kNoColumn if not found
+    static ColumnID Find(const std::string& path);
+
+    /// \brief Find the branch for column \a id in \a tr
+    ///
+    /// \a sname is the full branch name, used on the first lookup and to
+    /// validate the cached result on subsequent ones. With kNoColumn this
+    /// falls back to a plain TTree::GetBranch()
+    static TBranch* GetBranch(TTree* tr, ColumnID id, const std::string& sname);
+
+  protected:
+    /// Single pass over the branches of \a tr
+    static void IndexTree(TTree* tr);
+
+    /// Function-local static, since the generated code fills it during
+    /// static initialization. Only read after that
+    static std::vector<const char*>& Paths();
+
+    // The lookups below are per-thread, since threads (e.g. MakeShards())
+    // each read their own tree
+
+    static thread_local TTree* fgTree; ///< The tree fgBranchIdx was built from
+    /// Branch name to position in the tree's list of branches
+    static thread_local std::unordered_map<std::string, int> fgBranchIdx;
+    /// ColumnID to position in the tree's list of branches, or -1
+    static thread_local std::vector<int> fgColIdx;
+  };
+
+  template<class U> class SRCachedColumn;
+  template<class U> class SRSharedColumn;
+  struct SRMappedColumn;
+  class SRNTupleColumn;
+  class SRSharedFormula;
+  class SRPrefixSum;
+
+  /// \brief Optional in-memory cache of decoded flat columns
+  ///
+  /// Disabled by default. Once enabled, every flat branch read through the
+  /// proxies is retained in memory, keyed by file, tree and branch, until the
+  /// memory cap is reached. Later passes over the same file are then served
+  /// from memory without touching ROOT I/O. Only the entries the proxies
+  /// actually read are recorded, so enabling the cache only makes sense for
+  /// workflows that loop over the same files repeatedly. Strings are counted
+  /// against the cap including their heap allocations.
+  class SRColumnCache
+  {
+  public:
+    /// Zero (the default) disables the cache
+    static void SetMaxBytes(size_t max){fgMaxBytes = max;}
+    static size_t GetMaxBytes(){return fgMaxBytes;}
+    static size_t GetBytesUsed(){return fgBytesUsed;}
+
+    /// Release all cached columns
+    static void clear();
+
+  protected:
+    template<class T> friend class Proxy;
+
+    template<class U> friend class SRCachedColumn;
+
+    /// Returns null if the cache is disabled or the column couldn't be kept
+    template<class U> static std::shared_ptr<SRCachedColumn<U>> GetColumn(TTree* tr, const std::string& branch);
+
+    /// Book-keeping for SRCachedColumn. Returns false if over the cap
+    static bool Reserve(size_t bytes);
+    static void Release(size_t bytes){fgBytesUsed -= bytes;}
+
+    static size_t fgMaxBytes;
+    static size_t fgBytesUsed;
+  };
+
+  /// \brief Optional node-local cache of decoded flat clusters, shared
+  /// between processes
+  ///
+  /// Disabled by default. Once enabled, the values of each flat branch are
+  /// decoded a whole cluster at a time and published as a file in a
+  /// directory on tmpfs, named after the file's UUID, the branch and the
+  /// cluster. Any other job on the node reading the same cluster of the same
+  /// branch maps the published file instead of decompressing the baskets
+  /// again. Files are written under a temporary name and renamed into place,
+  /// so readers never need a lock and never see a partial file. Once the
+  /// directory exceeds the cap, the least-recently used files are removed.
+  /// Jobs that already mapped them are unaffected.
+  ///
+  /// Can also be enabled with the environment variable
+  /// SRPROXY_SHARED_CACHE_MB. String branches are never shared.
+  class SRSharedCache
+  {
+  public:
+    /// \param maxBytes Cap on the size of the directory. Zero (the default)
+    ///                 disables the cache
+    /// \param dir      Empty means /dev/shm/srproxy.<uid>. Only the owner
+    ///                 can read or write the default location
+    static void SetMaxBytes(size_t maxBytes, const std::string& dir = "");
+    static size_t GetMaxBytes();
+    static std::string GetDirectory();
+
+    /// Remove every published file, for all jobs using the directory
+    static void clear();
+
+  protected:
+    template<class T> friend class Proxy;
+
+    template<class U> friend class SRSharedColumn;
+
+    /// Returns null if the cache is disabled
+    template<class U> static std::shared_ptr<SRSharedColumn<U>> GetColumn(TTree* tr, const std::string& branch);
+
+    /// Account for a newly-published file, evicting others if necessary
+    static void Published(size_t bytes);
+    /// Remove the least-recently used files until under the cap
+    static void Trim();
+
+    static void Init();
+
+    static bool fgInit;
+    static size_t fgMaxBytes;
+    static std::string fgDir;
+    static size_t fgBytesSinceTrim;
+  };
+
   /// Count the subscripts in the name
   int NSubscripts(const std::string& name);
 
@@ -50,33 +299,127 @@ namespace caf
 
   class Restorer;
 
-  /// Base class for all proxy types, intended to help trace ancestry
+  /// Identifies the value a basic proxy holds, see SRMemo
+  struct SRVersion
+  {
+    long long entry; ///< Entry or bound record the value came from
+    long pos;        ///< Position within it, for re-pointed proxies
+    long long stamp; ///< Changed on every assignment and restore
+
+    bool operator==(const SRVersion& v) const
+    {
+      return entry == v.entry && pos == v.pos && stamp == v.stamp;
+    }
+  };
+
+  /// A basic proxy read while computing a memoized value
+  struct SRDependency
+  {
+    SRVersion (*version)(const void*); ///< Current version of proxy
+    const void* proxy;
+    SRVersion seen; ///< Version when it was read
+  };
+
+  /// \brief Records the proxies read while an SRMemo computes its value
+  class SRDependencyTracker
+  {
+  public:
+    static bool Recording(){return fgCurrent;}
+
+    static void Add(const SRDependency& d){fgCurrent->push_back(d);}
+
+    /// Direct the reads to \a deps (or nowhere, if null). Returns the
+    /// previous target, to be restored afterwards
+    static std::vector<SRDependency>* Record(std::vector<SRDependency>* deps)
+    {
+      std::vector<SRDependency>* ret = fgCurrent;
+      fgCurrent = deps;
+      return ret;
+    }
+
+    static long long NextStamp(){return ++fgStamp;}
+
+  protected:
+    static std::vector<SRDependency>* fgCurrent;
+    static long long fgStamp;
+  };
+
+  /// \brief Base class for all proxy types, intended to help trace ancestry
+  ///
+  /// Vectors and arrays are transparent: their elements point to the
+  /// container's parent, so the parent of any element is always the enclosing
+  /// record, however it is reached.
   class Lineage
   {
     public:
       /// note: this is NOT a copy constructor!  Specifies the object that's this one's parent.
       explicit Lineage(const Lineage * parent) : fParent(parent) {}
+      /// Same parent, but the cache starts afresh
+      Lineage(const Lineage& l) : fParent(l.fParent) {}
       virtual ~Lineage() = default;
 
       /// \brief Search through the stored lineage to find ancestor of given type.  If multiple, returns only the closest one.
+      ///
+      /// The parent chain never changes once the proxies are built, so the
+      /// answer is remembered, and repeated lookups (e.g. once per event) are
+      /// a pointer load.
+      ///
       /// \tparam T   Object type to look for (e.g.: SRProxy)
       /// \return  Pointer to closest ancestor (fewest links separating them) of type T, or nullptr if none found
       template <typename T>
       const T * Ancestor() const
       {
+        const void* tag = AncestorTag<T>();
+        if(fAncCache){
+          for(const AncestorCache::Entry& e: fAncCache->entries){
+            if(e.tag == tag) return (const T*)e.anc;
+          }
+        }
+
+        const T* ret = nullptr;
         const Lineage * candAnc = this;
         while ( (candAnc = candAnc->Parent()) )
         {
-          if (auto ret = dynamic_cast<const T*>(candAnc))
-            return ret;
+          if ( (ret = dynamic_cast<const T*>(candAnc)) )
+            break;
         }
-        return nullptr;
+
+        // Two entries covers the common case of looking up both the slice and
+        // the whole record from the same object
+        if(!fAncCache) fAncCache = std::make_unique<AncestorCache>();
+        fAncCache->entries[fAncCache->next] = {tag, ret};
+        fAncCache->next = (fAncCache->next+1)%AncestorCache::kN;
+        return ret;
       }
 
       const Lineage * Parent() const { return fParent; }
 
     private:
+      /// A unique address per type, cheaper to compare than typeid
+      template <typename T> static const void* AncestorTag()
+      {
+        static const char tag = 0;
+        return &tag;
+      }
+
+      struct AncestorCache
+      {
+        static const int kN = 2;
+
+        struct Entry
+        {
+          const void* tag; ///< from AncestorTag()
+          const void* anc; ///< may be null, if there is no such ancestor
+        };
+
+        Entry entries[kN] = {};
+        int next = 0;
+      };
+
       const Lineage * fParent = nullptr;
+      /// Only allocated by the first lookup. Most proxies, e.g. every leaf,
+      /// never do one, and would otherwise carry the cache's bytes anyway
+      mutable std::unique_ptr<AncestorCache> fAncCache;
   };
 
   template<class T> class Proxy : public Lineage
@@ -86,10 +429,13 @@ namespace caf
 
     friend class Restorer;
 
-    Proxy(TTree *tr, const std::string &name, const long &base, int offset, const Lineage * parent = nullptr);
+    Proxy(TTree *tr, const std::string &name, const long &base, int offset, const Lineage * parent = nullptr, ColumnID col = kNoColumn);
     Proxy(TTree* tr, const std::string& name) : Proxy(tr, name, kDummyBase, 0, nullptr)
     {}
 
+    /// A basic type is a single leaf
+    static constexpr int kNColumns = 1;
+
     // Need to be copyable because Vars return us directly
     Proxy(const Proxy&);
     Proxy(const Proxy&&);
@@ -117,12 +463,26 @@ namespace caf
 
     void CheckEquals(const T& x) const;
 
+    /// Read directly from \a x from now on, see BindRecord()
+    void Bind(const T* x)
+    {
+      fType = kBound;
+      fBoundPtr = x;
+    }
+
   protected:
+    /// For dependency tracking
+    SRVersion Version() const;
+    static SRVersion VersionOf(const void* p){return ((const Proxy<T>*)p)->Version();}
+
     // Print a warning on inf or NaN
     T GetValueChecked() const;
 
     T GetValueNested() const;
     T GetValueFlat() const;
+    /// For kMapped and kNTuple, which are read column by column without
+    /// any branches
+    T GetValueColumnar() const;
 
     void SetShifted();
 
@@ -136,15 +496,36 @@ namespace caf
     mutable TLeaf* fLeaf;
     mutable U fVal;
     TTree* fTree;
+    long long fStamp; ///< From SRDependencyTracker::NextStamp() on each write
 
     // Flat
     const long& fBase;
     int fOffset;
+    ColumnID fCol;
+    /// fBase+fOffset when fVal was read. Differs within an entry only for
+    /// the reusable cursors of views()
+    mutable long fValPos;
+    mutable std::shared_ptr<SRCachedColumn<U>> fCached;
+    /// From other jobs on the node, in place of fCached
+    mutable std::shared_ptr<SRSharedColumn<U>> fShm;
+    /// Branch is in a friend tree, i.e. another part of a split file
+    mutable bool fFriend;
+
+    // Mapped
+    mutable const SRMappedColumn* fMapped;
+
+    // RNTuple
+    mutable const SRNTupleColumn* fNTuple;
+
+    // Bound
+    const T* fBoundPtr;
 
     // Nested
     mutable TFormLeafInfo* fLeafInfo;
     mutable TBranch* fBranch;
     mutable TTreeFormula* fTTF;
+    /// In place of fTTF, for elements of vectors of records
+    mutable std::shared_ptr<SRSharedFormula> fShared;
     mutable long fEntry;
     mutable int fSubIdx;
   };
@@ -160,15 +541,33 @@ namespace caf
                          const std::string& name,
                          bool isNestedContainer,
                          const long& base, int offset,
-                         const Lineage * parent = nullptr);
+                         const Lineage * parent = nullptr,
+                         ColumnID col = kNoColumn);
 
     virtual ~ArrayVectorProxyBase();
 
     void EnsureIdxP() const;
 
+    /// Load fIdx for the current entry. Call EnsureIdxP() first.
+    void UpdateIdx() const
+    {
+      if(fIdxP) fIdx = *fIdxP; // store into an actual value we can point to
+      else if(fPrefix) fIdx = PrefixIdx();
+    }
+
+    /// fIdx for files written without ..idx, from the running sum of ..length
+    long PrefixIdx() const;
+
     void CheckIndex(size_t i, size_t size) const;
 
     std::string IndexField() const;
+    /// Column of IndexField()
+    virtual ColumnID IndexColumn() const;
+    /// \brief Field whose running sum IndexField() holds, or empty
+    ///
+    /// Lets the index be rebuilt when it wasn't written. Only vectors have
+    /// one, arrays always write their index.
+    virtual std::string IdxLengthField() const {return "";}
 
     /// add [i], or something more complex for nested CAFs
     std::string Subscript(int i) const;
@@ -184,7 +583,9 @@ namespace caf
     CAFType fType;
     const long& fBase;
     int fOffset;
+    ColumnID fCol;
     mutable Proxy<long long>* fIdxP;
+    mutable std::shared_ptr<SRPrefixSum> fPrefix; ///< In place of fIdxP
     mutable long fIdx;
   };
 
@@ -200,32 +601,74 @@ namespace caf
 
   protected:
     VectorProxyBase(TTree* tr, const std::string& name, bool isNestedContainer, const long& base, int offset,
-                    const Lineage * parent = nullptr);
+                    const Lineage * parent = nullptr, ColumnID col = kNoColumn);
 
     std::string LengthField() const;
+    ColumnID IndexColumn() const override;
+    std::string IdxLengthField() const override;
     /// Helper for LengthField()
     std::string NName() const;
 
     void EnsureSizeExists() const;
+
+    /// Helper for CheckEquals()
+    void CheckSizeEquals(size_t n, size_t x) const;
+
+    /// Whether views() can use a reusable cursor rather than the elements
+    bool CanUseCursor() const;
+
+    /// \brief Called when a proxy of \a tr is assigned to outside of a
+    /// transaction, in entry \a entry
+    ///
+    /// Such values are held only by the proxy assigned to, where a cursor
+    /// wouldn't see them, so views() uses the elements for the rest of the
+    /// entry. Elements don't know their vector, so this is per-tree.
+    static void NoteAssigned(const TTree* tr, long long entry);
+
     mutable Proxy<int>* fSize; ///< only initialized on-demand
+
+    /// The last entry of each tree in which NoteAssigned() was called
+    static std::unordered_map<const TTree*, long long> fgAssigned;
+
+    template<class T> friend class Proxy;
   };
 
   template<class T> class Proxy<std::vector<T>>: public VectorProxyBase
   {
   public:
-    Proxy(TTree *tr, const std::string &name, const long &base, int offset, const Lineage *parent)
-      : VectorProxyBase(tr, name, is_vec<T>::value || std::is_array_v<T>, base, offset, parent)
+    Proxy(TTree *tr, const std::string &name, const long &base, int offset, const Lineage *parent, ColumnID col = kNoColumn)
+      : VectorProxyBase(tr, name, is_vec<T>::value || std::is_array_v<T>, base, offset, parent, col)
     {
     }
 
     Proxy(TTree* tr, const std::string& name) : Proxy(tr, name, kDummyBase, 0, nullptr)
     {}
 
+    /// ..length, ..idx, and then the columns of the elements
+    static constexpr int kNColumns = 2 + Proxy<T>::kNColumns;
+
     ~Proxy(){for(Proxy<T>* e: fElems) delete e;}
 
     Proxy& operator=(const Proxy<std::vector<T>>&) = delete;
     Proxy(const Proxy<std::vector<T>>& v) = delete;
 
+    /// \brief Read directly from \a v from now on, see BindRecord()
+    ///
+    /// The elements are re-pointed at the contents of \a v as they are
+    /// accessed, so \a v may change between events.
+    void Bind(const std::vector<T>* v)
+    {
+      fType = kBound;
+      fBound = v;
+      // Elements created before now point into whatever they read before
+      for(size_t i = 0; i < std::min(fElems.size(), v->size()); ++i){
+        if(fElems[i]) BindElem(i);
+      }
+    }
+
+    size_t size() const {return fBound ? fBound->size() : VectorProxyBase::size();}
+    bool empty() const {return size() == 0;}
+
     Proxy<T>& at(size_t i) const {EnsureLongEnough(i); return *fElems[i];}
     Proxy<T>& at(size_t i)       {EnsureLongEnough(i); return *fElems[i];}
 
@@ -242,17 +685,20 @@ namespace caf
     template<class U>
     void CheckEquals(const std::vector<U>& x) const
     {
-      EnsureSizeExists();
-      fSize->CheckEquals(x.size());
+      // Not fSize, which a bound vector never reads
+      CheckSizeEquals(size(), x.size());
       for(unsigned int i = 0; i < std::min(size(), x.size()); ++i) at(i).CheckEquals(x[i]);
     }
 
 
     // U should be either T or const T
+    //
+    // The range is bounded by size() in end(), and the index base is loaded
+    // in begin(), so dereferencing doesn't need to repeat either.
     template<class U> class iterator
     {
     public:
-      Proxy<T>& operator*() {return (*fParent)[fIdx];}
+      Proxy<T>& operator*() {return fParent->Elem(fIdx);}
       iterator<U>& operator++(){++fIdx; return *this;}
       bool operator!=(const iterator<U>& it) const {return fIdx != it.fIdx;}
       bool operator==(const iterator<U>& it) const {return fIdx == it.fIdx;}
@@ -264,26 +710,148 @@ namespace caf
       size_t fIdx;
     };
 
-    iterator<const T> begin() const {return iterator<const T>(this, 0     );}
-    iterator<      T> begin()       {return iterator<      T>(this, 0     );}
+    iterator<const T> begin() const {LoadIdx(); return iterator<const T>(this, 0     );}
+    iterator<      T> begin()       {LoadIdx(); return iterator<      T>(this, 0     );}
     iterator<const T> end()   const {return iterator<const T>(this, size());}
     iterator<      T> end()         {return iterator<      T>(this, size());}
 
+  protected:
+    /// A reusable element proxy, re-pointed at each element in turn by
+    /// changing fPos
+    struct Cursor
+    {
+      Cursor(const Proxy<std::vector<T>>* v)
+        : fPos(0),
+          fElem(v->fTree, v->SubName()+"[*]", fPos, 0, v->Parent(), SubColumn(v->fCol, 2)),
+          fInUse(false)
+      {
+      }
+
+      long fPos; ///< Position of the element in the flat arrays
+      Proxy<T> fElem;
+      bool fInUse;
+    };
+
+  public:
+    /// \brief Read-only range of the elements, with no proxy per element
+    ///
+    /// In flat files every element is visited through one reusable proxy,
+    /// re-pointed at each element in turn, so that the proxy trees of the
+    /// individual elements are never built. The reference handed out is only
+    /// valid until the iterator is next advanced. Nested files, and
+    /// iteration while systematic shifts are in effect (they're stored in
+    /// the individual elements), use the regular elements instead.
+    ///
+    /// for(const auto& trk: slc.trk.views()) ...
+    class ViewRange
+    {
+    public:
+      class iterator
+      {
+      public:
+        const Proxy<T>& operator*() const
+        {
+          if(!fCursor) return fParent->Elem(fIdx);
+          fCursor->fPos = fParent->fIdx + fIdx;
+          return fCursor->fElem;
+        }
+        iterator& operator++(){++fIdx; return *this;}
+        bool operator!=(const iterator& it) const {return fIdx != it.fIdx;}
+        bool operator==(const iterator& it) const {return fIdx == it.fIdx;}
+      protected:
+        friend class ViewRange;
+        iterator(const Proxy<std::vector<T>>* p, Cursor* c, size_t i) : fParent(p), fCursor(c), fIdx(i) {}
+
+        const Proxy<std::vector<T>>* fParent;
+        Cursor* fCursor;
+        size_t fIdx;
+      };
+
+      ViewRange(const ViewRange&) = delete;
+      ~ViewRange(){if(fCursor) fCursor->fInUse = false;}
+
+      iterator begin() const {return iterator(fParent, fCursor, 0);}
+      iterator end() const {return iterator(fParent, fCursor, fSize);}
+
+    protected:
+      friend class Proxy<std::vector<T>>;
+      ViewRange(const Proxy<std::vector<T>>* p, Cursor* c, size_t n) : fParent(p), fCursor(c), fSize(n) {}
+
+      const Proxy<std::vector<T>>* fParent;
+      Cursor* fCursor;
+      size_t fSize;
+    };
+
+    ViewRange views() const
+    {
+      const size_t n = size();
+      LoadIdx();
+      return ViewRange(this, CanUseCursor() ? AcquireCursor() : 0, n);
+    }
+
   protected:
     /// Implies CheckIndex()
     void EnsureLongEnough(size_t i) const
     {
       CheckIndex(i, size());
-      if(i >= fElems.size()) fElems.resize(i+1);
+      LoadIdx();
+      Elem(i);
+    }
 
+    void LoadIdx() const
+    {
       EnsureIdxP();
-      if(fIdxP) fIdx = *fIdxP; // store into an actual value we can point to
+      UpdateIdx();
+    }
+
+    /// Element \a i, creating it if necessary. Doesn't check the index or
+    /// load fIdx.
+    Proxy<T>& Elem(size_t i) const
+    {
+      if(i >= fElems.size()) fElems.resize(i+1);
 
       // note that the contained elements should point to the vector's parent, not the vector
-      if(!fElems[i]) fElems[i] = new Proxy<T>(fTree, Subscript(i), fIdx, i, this->Parent());
+      if(!fElems[i]) fElems[i] = new Proxy<T>(fTree, Subscript(i), fIdx, i, this->Parent(), SubColumn(fCol, 2));
+      if(fBound) BindElem(i);
+      return *fElems[i];
+    }
+
+    /// The vector may have been reallocated since the element was last used.
+    /// Records only rebind their own members if the address changed.
+    void BindElem(size_t i) const
+    {
+      if constexpr(std::is_same_v<T, bool>){
+        // std::vector<bool> has no addressable elements
+        if(fBoolEvent != SRBoundRecord::Event()){
+          fBoolEvent = SRBoundRecord::Event();
+          fBoolCopy.reset(new bool[fBound->size()]);
+          std::copy(fBound->begin(), fBound->end(), fBoolCopy.get());
+        }
+        fElems[i]->Bind(&fBoolCopy[i]);
+      }
+      else{
+        fElems[i]->Bind(&(*fBound)[i]);
+      }
+    }
+
+    Cursor* AcquireCursor() const
+    {
+      // Usually only one, but the same vector may be iterated in nested loops
+      for(const std::unique_ptr<Cursor>& c: fCursors){
+        if(!c->fInUse){c->fInUse = true; return c.get();}
+      }
+      fCursors.emplace_back(new Cursor(this));
+      fCursors.back()->fInUse = true;
+      return fCursors.back().get();
     }
 
     mutable std::vector<Proxy<T>*> fElems;
+    mutable std::vector<std::unique_ptr<Cursor>> fCursors;
+
+    const std::vector<T>* fBound = nullptr;
+    /// Only used for std::vector<bool>
+    mutable std::unique_ptr<bool[]> fBoolCopy;
+    mutable long long fBoolEvent = -1;
   };
 
   // Retain an alias to the old naming scheme for now
@@ -305,8 +873,8 @@ namespace caf
   template<class T, unsigned int N> class Proxy<T[N]> : public ArrayVectorProxyBase
   {
   public:
-    Proxy(TTree *tr, const std::string &name, const long &base, int offset, const Lineage *parent)
-      : ArrayVectorProxyBase(tr, name, is_vec<T>::value || std::is_array_v<T>, base, offset)
+    Proxy(TTree *tr, const std::string &name, const long &base, int offset, const Lineage *parent, ColumnID col = kNoColumn)
+      : ArrayVectorProxyBase(tr, name, is_vec<T>::value || std::is_array_v<T>, base, offset, parent, col)
     {
       fElems.fill(0); // ensure initialized to null
     }
@@ -314,6 +882,13 @@ namespace caf
     Proxy(TTree* tr, const std::string& name) : Proxy(tr, name, kDummyBase, 0, nullptr)
     {}
 
+    /// Whether flat::FlatArray writes this array inline
+    static constexpr bool kInline = N <= kMaxInlineArraySize;
+
+    /// Only the layout that is written has columns. The other is still read,
+    /// from older files, by branch name
+    static constexpr int kNColumns = kInline ? N*Proxy<T>::kNColumns : 1 + Proxy<T>::kNColumns;
+
     ~Proxy()
     {
       for(Proxy<T>* e: fElems) delete e;
@@ -325,16 +900,27 @@ namespace caf
     const Proxy<T>& operator[](size_t i) const
     {
       EnsureElem(i);
-      if(fIdxP) fIdx = *fIdxP;
+      UpdateIdx();
       return *fElems[i];
     }
     Proxy<T>& operator[](size_t i)
     {
       EnsureElem(i);
-      if(fIdxP) fIdx = *fIdxP;
+      UpdateIdx();
       return *fElems[i];
     }
 
+    /// Read directly from \a x from now on, see BindRecord()
+    void Bind(const T (*x)[N])
+    {
+      fType = kBound;
+      fBound = x;
+      // Elements created before now still point at the old array
+      for(unsigned int i = 0; i < N; ++i){
+        if(fElems[i]) fElems[i]->Bind(&(*x)[i]);
+      }
+    }
+
     Proxy<T[N]>& operator=(const T (&x)[N])
     {
       for(unsigned int i = 0; i < N; ++i) (*this)[i] = x[i];
@@ -347,30 +933,125 @@ namespace caf
     }
 
   protected:
+    ColumnID IndexColumn() const override
+    {
+      return kInline ? kNoColumn : SubColumn(fCol, 0);
+    }
+
     void EnsureElem(int i) const
     {
       CheckIndex(i, N);
       if(fElems[i]) return; // element already created
 
-      if(fType != kFlat || TreeHasLeaf(fTree, IndexField())){
+      if(!IsFlatLayout(fType) || TreeHasLeaf(fTree, IndexField())){
         // Regular out-of-line array, handled the same as a vector.
         EnsureIdxP();
-        fElems[i] = new Proxy<T>(fTree, Subscript(i), fIdx, i, nullptr);
+        fElems[i] = new Proxy<T>(fTree, Subscript(i), fIdx, i, this->Parent(),
+                                 kInline ? kNoColumn : SubColumn(fCol, 1));
       }
       else{
         // No ..idx field implies this is an "inline" array where the elements
         // are in individual branches like foo.0.bar
         const std::string dotname = fName+"."+std::to_string(i);
-        fElems[i] = new Proxy<T>(fTree, dotname, fBase, fOffset, nullptr);
+        fElems[i] = new Proxy<T>(fTree, dotname, fBase, fOffset, this->Parent(),
+                                 kInline ? SubColumn(fCol, i*Proxy<T>::kNColumns) : kNoColumn);
       }
+
+      // Bind() re-points the elements that already exist when it's called
+      if(fBound) fElems[i]->Bind(&(*fBound)[i]);
     }
 
     mutable std::array<Proxy<T>*, N> fElems;
+
+    const T (*fBound)[N] = nullptr;
   };
 
   // Retain an alias to the old naming scheme for now
   template <class T, unsigned int N> using ArrayProxy = Proxy<T[N]>;
 
+  /// \brief A sub-record proxy that is only built when first used
+  ///
+  /// gen_srproxy --lazy declares sub-record members this way, so that
+  /// building a proxy tree only costs in proportion to the fields used.
+  /// Reach the members with -> rather than . (sr.hdr->run), or convert to a
+  /// reference to the proxy itself.
+  template<class P> class Lazy
+  {
+  public:
+    Lazy(TTree* tr, const std::string& name, const long& base, int offset, const Lineage* parent, ColumnID col)
+      : fTree(tr), fName(name), fBase(base), fOffset(offset), fParent(parent), fCol(col)
+    {
+    }
+
+    Lazy(const Lazy&) = delete;
+    Lazy& operator=(const Lazy&) = delete;
+
+    const P& operator*() const {return Get();}
+    P& operator*() {return Get();}
+    const P* operator->() const {return &Get();}
+    P* operator->() {return &Get();}
+
+    operator const P&() const {return Get();}
+    operator P&() {return Get();}
+
+    template<class U> Lazy& operator=(const U& x)
+    {
+      Get() = x;
+      return *this;
+    }
+
+    template<class U> void CheckEquals(const U& x) const {Get().CheckEquals(x);}
+
+    /// Forwarded once the proxy is built, see BindRecord()
+    template<class U> void Bind(const U* x)
+    {
+      if(fObj){fObj->Bind(x); return;}
+      fBound = x;
+      fBindFn = [](P& p, const void* x){p.Bind((const U*)x);};
+    }
+
+    /// Has anything used this proxy yet?
+    bool IsBuilt() const {return bool(fObj);}
+
+  protected:
+    P& Get() const
+    {
+      if(!fObj){
+        fObj.reset(new P(fTree, fName, fBase, fOffset, fParent, fCol));
+        if(fBindFn) fBindFn(*fObj, fBound);
+      }
+      return *fObj;
+    }
+
+    TTree* fTree;
+    std::string fName;
+    const long& fBase;
+    int fOffset;
+    const Lineage* fParent;
+    ColumnID fCol;
+
+    mutable std::unique_ptr<P> fObj;
+
+    /// Bind() to apply once built
+    const void* fBound = nullptr;
+    void (*fBindFn)(P&, const void*) = nullptr;
+  };
+
+  /// \brief Point the proxy tree \a p at the record \a rec in memory
+  ///
+  /// Nothing is copied. The proxies read the fields of \a rec in place, so
+  /// the same cuts and systematics used on files run on a live record, for
+  /// example in the CAF-maker. \a p must have been constructed with a null
+  /// tree. Call once per event, even if \a rec is reused, since this is also
+  /// what ends the systematic shifts of the previous one. Shifts apply to
+  /// the proxies and never write to \a rec. Assigning whole vectors is not
+  /// supported.
+  template<class P, class T> void BindRecord(P& p, const T& rec)
+  {
+    SRBoundRecord::NextEvent();
+    p.Bind(&rec);
+  }
+
 
   template<class T> class RestorerT
   {
@@ -380,17 +1061,20 @@ namespace caf
       // Restore values in reverse, i.e. in first-in, last-out order so that if
       // a value was edited multiple time it will eventually be restored to its
       // original value.
-      for(auto it = fVals.rbegin(); it != fVals.rend(); ++it)
-        *it->first = it->second;
+      for(auto it = fVals.rbegin(); it != fVals.rend(); ++it){
+        *std::get<0>(*it) = std::get<1>(*it);
+        // So that memoized values computed from the shift are dropped
+        *std::get<2>(*it) = SRDependencyTracker::NextStamp();
+      }
     }
 
-    void Add(T* p, T v)
+    void Add(T* p, T v, long long* stamp)
     {
-      fVals.emplace_back(p, v);
+      fVals.emplace_back(p, v, stamp);
     }
 
   protected:
-    std::vector<std::pair<T*, T>> fVals;
+    std::vector<std::tuple<T*, T, long long*>> fVals;
   };
 
   class Restorer: public
@@ -413,7 +1097,7 @@ namespace caf
   public:
     template<class T> void Add(Proxy<T>& p)
     {
-      RestorerT<typename Proxy<T>::U>::Add(&p.fVal, p.GetValue());
+      RestorerT<typename Proxy<T>::U>::Add(&p.fVal, p.GetValue(), &p.fStamp);
     }
   };
 
@@ -445,7 +1129,8 @@ namespace caf
     }
 
     /// May be useful in the implementation of caches that ought to be
-    /// invalidated when systematic shifts are applied.
+    /// invalidated when systematic shifts are applied. SRMemo only
+    /// invalidates values that read the shifted fields.
     static long long Generation()
     {
       if(!InTransaction()) return 0; // nominal
@@ -469,6 +1154,82 @@ namespace caf
     static long long fGeneration;
   };
 
+  /// \brief A derived value, recomputed only when something it read changes
+  ///
+  /// While the value is computed, every basic proxy it reads is recorded,
+  /// along with the entry and the version of the value it held. The value is
+  /// reused until any of those change: a new entry, or an assignment to (or
+  /// restore of) one of those proxies by a systematic shift. Shifts of other
+  /// fields leave it alone. Memos used within the computation pass their
+  /// own inputs on.
+  ///
+  /// Only reads through the proxies are tracked, so \a func must depend on
+  /// nothing else, and the proxies must outlive the memo. A value that read
+  /// no proxies at all is recomputed every time.
+  template<class R> class SRMemo
+  {
+  public:
+    SRMemo() : fSet(false) {}
+
+    template<class F> const R& Get(F&& func)
+    {
+      if(!Valid()){
+        fDeps.clear();
+        std::vector<SRDependency>* prev = SRDependencyTracker::Record(&fDeps);
+        // Leave the tracker as it was even if func throws
+        struct Reset{std::vector<SRDependency>* p; ~Reset(){SRDependencyTracker::Record(p);}} reset{prev};
+        fVal = func();
+        fSet = true;
+      }
+
+      // The enclosing computation, if any, depends on the same inputs
+      if(SRDependencyTracker::Recording()){
+        for(const SRDependency& d: fDeps) SRDependencyTracker::Add(d);
+      }
+
+      return fVal;
+    }
+
+    void Invalidate(){fSet = false;}
+
+  protected:
+    bool Valid() const
+    {
+      if(!fSet || fDeps.empty()) return false;
+      for(const SRDependency& d: fDeps){
+        if(!(d.version(d.proxy) == d.seen)) return false;
+      }
+      return true;
+    }
+
+    R fVal;
+    bool fSet;
+    std::vector<SRDependency> fDeps;
+  };
+
+  /// \brief Memoize a function of a proxy, separately for each proxy object
+  ///
+  /// SRMemoized<double, caf::SRSliceProxy> energy([](const caf::SRSliceProxy& s){...});
+  /// energy(slc) is then only recomputed when the entry, or a field it read,
+  /// changes.
+  template<class R, class A> class SRMemoized
+  {
+  public:
+    SRMemoized(std::function<R(const A&)> f) : fFunc(f) {}
+
+    const R& operator()(const A& a) const
+    {
+      return fMemos[&a].Get([&](){return fFunc(a);});
+    }
+
+    /// Call before the proxies the memos were computed from are destroyed
+    void clear(){fMemos.clear();}
+
+  protected:
+    std::function<R(const A&)> fFunc;
+    mutable std::unordered_map<const A*, SRMemo<R>> fMemos;
+  };
+
 } // namespace
 
 namespace std
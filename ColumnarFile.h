@@ -0,0 +1,460 @@
+#pragma once
+
+#include "SRProxy/BasicTypesProxy.h"
+
+#include "TBranch.h"
+#include "TFile.h"
+#include "TLeaf.h"
+#include "TTree.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace caf
+{
+  /// \brief Uncompressed columnar copy of (some of) the branches of a flat CAF
+  ///
+  /// Each column holds the values of one flat branch, in the same
+  /// ..length/..idx layout, along with the offset of each entry's first
+  /// value. Every array starts on a page boundary so that the file can be
+  /// memory-mapped and read in place. Files are written in native byte order
+  /// and are intended as a local sidecar for repeated reads, not for archival.
+  namespace columnar
+  {
+    const char kMagic[8] = {'S', 'R', 'P', 'X', 'C', 'O', 'L', '1'};
+    const uint64_t kPageSize = 4096;
+
+    struct FileHeader
+    {
+      char magic[8];
+      uint64_t nentries;
+      uint64_t ncolumns;
+      uint64_t dirpos; ///< Position of the column directory
+    };
+
+    /// Directory entry, followed by the name and padding to 8 bytes
+    struct ColumnHeader
+    {
+      uint64_t offsetspos; ///< nentries+1 uint64_t
+      uint64_t valuespos;
+      uint64_t nvalues;
+      uint32_t namelen;
+      char code; ///< ROOT leaflist type code
+      char pad[3];
+    };
+
+    /// Leaflist code of the type stored in \a leaf, or zero if unsupported
+    inline char TypeCode(const TLeaf* leaf)
+    {
+      const std::string t = leaf->GetTypeName();
+      if(t == "Char_t") return 'B';
+      if(t == "UChar_t") return 'b';
+      if(t == "Short_t") return 'S';
+      if(t == "UShort_t") return 's';
+      if(t == "Int_t") return 'I';
+      if(t == "UInt_t") return 'i';
+      // Truncated types are full width in memory
+      if(t == "Float_t" || t == "Float16_t") return 'F';
+      if(t == "Double_t" || t == "Double32_t") return 'D';
+      if(t == "Long64_t") return 'L';
+      if(t == "ULong64_t") return 'l';
+      if(t == "Long_t") return 'G';
+      if(t == "ULong_t") return 'g';
+      if(t == "Bool_t") return 'O';
+      return 0;
+    }
+
+    /// Whether \a code is one of the type codes the files use
+    inline bool ValidCode(char code)
+    {
+      return code && strchr("BbOSsIiFDLlGg", code);
+    }
+
+    inline int TypeSize(char code)
+    {
+      switch(code){
+      case 'B': case 'b': case 'O': return 1;
+      case 'S': case 's': return 2;
+      case 'I': case 'i': case 'F': return 4;
+      case 'D': case 'L': case 'l': case 'G': case 'g': return 8;
+      default: abort();
+      }
+    }
+
+    template<class V> V As(const char* p)
+    {
+      V ret;
+      memcpy(&ret, p, sizeof(V));
+      return ret;
+    }
+
+    /// Convert the value of type \a code at \a p, which need not be aligned
+    template<class U> void Decode(char code, const char* p, U& x)
+    {
+      switch(code){
+      case 'B': x = U(As<char>(p)); break;
+      case 'b': x = U(As<unsigned char>(p)); break;
+      case 'O': x = U(As<bool>(p)); break;
+      case 'S': x = U(As<short>(p)); break;
+      case 's': x = U(As<unsigned short>(p)); break;
+      case 'I': x = U(As<int>(p)); break;
+      case 'i': x = U(As<unsigned int>(p)); break;
+      case 'F': x = U(As<float>(p)); break;
+      case 'D': x = U(As<double>(p)); break;
+      case 'L': x = U(As<long long>(p)); break;
+      case 'l': x = U(As<unsigned long long>(p)); break;
+      case 'G': x = U(As<long>(p)); break;
+      case 'g': x = U(As<unsigned long>(p)); break;
+      default: abort();
+      }
+    }
+
+    /// Whether \a fname is a columnar file, rather than e.g. a ROOT one
+    inline bool IsColumnarFile(const std::string& fname)
+    {
+      char magic[sizeof(kMagic)] = {};
+      std::ifstream f(fname, std::ios::binary);
+      f.read(magic, sizeof(magic));
+      return f && memcmp(magic, kMagic, sizeof(kMagic)) == 0;
+    }
+
+    /// Pad with zeros to the next page boundary, returning the new position
+    inline uint64_t Align(FILE* f)
+    {
+      const uint64_t pos = ftell(f);
+      const uint64_t pad = (kPageSize - pos%kPageSize)%kPageSize;
+      static const char zeros[kPageSize] = {};
+      fwrite(zeros, 1, pad, f);
+      return pos+pad;
+    }
+  } // namespace columnar
+
+  /// One column of a memory-mapped columnar file
+  struct SRMappedColumn
+  {
+    char code;
+    uint64_t nentries;
+    uint64_t nvalues;
+    const uint64_t* offsets;
+    const char* values;
+
+    /// Returns false if \a entry or \a subidx is out of range
+    template<class U> bool Get(long entry, int subidx, U& x) const
+    {
+      if(entry < 0 || uint64_t(entry) >= nentries || subidx < 0) return false;
+      const uint64_t idx = offsets[entry] + subidx;
+      if(idx >= offsets[entry+1] || idx >= nvalues) return false;
+
+      columnar::Decode(code, values + idx*columnar::TypeSize(code), x);
+      return true;
+    }
+
+    /// Strings are stored as their characters, including the trailing null
+    bool Get(long entry, int subidx, std::string& x) const
+    {
+      if(entry < 0 || uint64_t(entry) >= nentries || subidx < 0) return false;
+      const uint64_t idx = offsets[entry] + subidx;
+      if(idx >= offsets[entry+1] || idx >= nvalues) return false;
+      x = values + idx;
+      return true;
+    }
+  };
+
+  /// \brief Presents a columnar file as a TTree that proxies can be built on
+  ///
+  /// The tree has no branches of its own. Its read entry is set with
+  /// GetEntry() or LoadTree() as usual, and the proxies (which detect it as
+  /// kMapped) read their values straight from the mapping.
+  class SRMappedTree: public TTree
+  {
+  public:
+    SRMappedTree(const std::string& fname)
+      : TTree("srproxy_mapped", fname.c_str()), fData(0), fSize(0)
+    {
+      SetDirectory(0); // we own ourselves
+
+      const int fd = open(fname.c_str(), O_RDONLY);
+      struct stat st;
+      if(fd < 0 || fstat(fd, &st) != 0){
+        std::cout << "SRMappedTree: unable to open '" << fname << "'" << std::endl;
+        abort();
+      }
+      fSize = st.st_size;
+
+      void* data = mmap(0, fSize, PROT_READ, MAP_SHARED, fd, 0);
+      close(fd); // the mapping keeps the file alive
+      if(data == MAP_FAILED || fSize < sizeof(columnar::FileHeader)){
+        std::cout << "SRMappedTree: unable to map '" << fname << "'" << std::endl;
+        abort();
+      }
+      fData = (const char*)data;
+
+      const columnar::FileHeader* hdr = (const columnar::FileHeader*)fData;
+      if(memcmp(hdr->magic, columnar::kMagic, sizeof(columnar::kMagic)) != 0){
+        std::cout << "SRMappedTree: '" << fname << "' is not a columnar file" << std::endl;
+        abort();
+      }
+
+      const uint64_t N = hdr->nentries;
+      SetEntries(N);
+
+      // Nothing below may be read before it has been checked to lie within
+      // the file, so that a truncated or corrupt file can't take us outside
+      // the mapping
+      uint64_t pos = hdr->dirpos;
+      for(uint64_t i = 0; i < hdr->ncolumns; ++i){
+        if(pos%8 != 0 || !Fits(pos, sizeof(columnar::ColumnHeader))) Corrupt(fname, "column directory");
+        const columnar::ColumnHeader* ch = (const columnar::ColumnHeader*)(fData + pos);
+        pos += sizeof(columnar::ColumnHeader);
+
+        if(!Fits(pos, ch->namelen)) Corrupt(fname, "column name");
+        const std::string name(fData + pos, ch->namelen);
+        pos += (uint64_t(ch->namelen)+7)/8*8;
+
+        if(ch->offsetspos%8 != 0 || N >= fSize/sizeof(uint64_t) ||
+           !Fits(ch->offsetspos, (N+1)*sizeof(uint64_t))) Corrupt(fname, "offsets of '"+name+"'");
+        const uint64_t* offsets = (const uint64_t*)(fData + ch->offsetspos);
+
+        if(!columnar::ValidCode(ch->code)) Corrupt(fname, "type of '"+name+"'");
+        const uint64_t size = columnar::TypeSize(ch->code);
+        const uint64_t nvalues = offsets[N];
+        if(nvalues > fSize/size || !Fits(ch->valuespos, nvalues*size)) Corrupt(fname, "values of '"+name+"'");
+
+        fColumns[name] = SRMappedColumn{ch->code, N, nvalues, offsets, fData + ch->valuespos};
+      }
+    }
+
+    ~SRMappedTree()
+    {
+      if(fData) munmap((void*)fData, fSize);
+    }
+
+    /// Returns null if the column is not in the file
+    const SRMappedColumn* GetColumn(const std::string& name) const
+    {
+      auto it = fColumns.find(name);
+      if(it == fColumns.end()) return 0;
+      return &it->second;
+    }
+
+    std::vector<std::string> ColumnNames() const
+    {
+      std::vector<std::string> ret;
+      for(const auto& it: fColumns) ret.push_back(it.first);
+      return ret;
+    }
+
+    Int_t GetEntry(Long64_t entry, Int_t = 0) override
+    {
+      fReadEntry = entry;
+      return 1;
+    }
+
+    Long64_t LoadTree(Long64_t entry) override
+    {
+      fReadEntry = entry;
+      return entry;
+    }
+
+  protected:
+    /// Whether \a len bytes from \a pos lie within the mapping
+    bool Fits(uint64_t pos, uint64_t len) const
+    {
+      return pos <= fSize && len <= fSize-pos;
+    }
+
+    static void Corrupt(const std::string& fname, const std::string& what)
+    {
+      std::cout << "SRMappedTree: '" << fname << "' is truncated or corrupt (" << what << ")" << std::endl;
+      abort();
+    }
+
+    const char* fData;
+    size_t fSize;
+    std::unordered_map<std::string, SRMappedColumn> fColumns;
+  };
+
+  /// \brief One field of an RNTuple, decoded an entry at a time
+  ///
+  /// Same interface as SRMappedColumn, for the proxies. The fields are read
+  /// in NTupleFile.h, which the proxies themselves don't depend on.
+  class SRNTupleColumn
+  {
+  public:
+    SRNTupleColumn(char c) : code(c), fEntry(-1), fValues(0), fN(0) {}
+    virtual ~SRNTupleColumn() {}
+
+    const char code;
+
+    /// Returns false if \a subidx is out of range for this entry
+    template<class U> bool Get(long entry, int subidx, U& x) const
+    {
+      if(entry != fEntry) Load(entry);
+      if(subidx < 0 || uint64_t(subidx) >= fN) return false;
+
+      columnar::Decode(code, fValues + subidx*columnar::TypeSize(code), x);
+      return true;
+    }
+
+    /// Strings are stored as their characters, including the trailing null
+    bool Get(long entry, int subidx, std::string& x) const
+    {
+      if(entry != fEntry) Load(entry);
+      if(subidx < 0 || uint64_t(subidx) >= fN) return false;
+
+      x = fValues + subidx;
+      return true;
+    }
+
+  protected:
+    /// Point fValues and fN at the values of \a entry
+    virtual void Load(long entry) const = 0;
+
+    mutable long fEntry;
+    mutable const char* fValues;
+    mutable uint64_t fN;
+  };
+
+  /// \brief What the proxies see of SRNTupleTree
+  ///
+  /// The proxies detect kNTuple by this base class, and read through
+  /// GetColumn(), so that only code opening RNTuple files needs NTupleFile.h
+  /// and the RNTuple headers (ROOT 6.36 or later).
+  class SRNTupleTreeBase: public TTree
+  {
+  public:
+    SRNTupleTreeBase(const char* name, const char* title) : TTree(name, title) {}
+
+    /// Returns null if the column is not in the file
+    virtual const SRNTupleColumn* GetColumn(const std::string& name) = 0;
+
+    /// Every column, named as the flat branches
+    virtual std::vector<std::string> ColumnNames() const = 0;
+  };
+
+  /// \brief Export branches of flat tree \a tr to a columnar file
+  ///
+  /// \param branches The branches to export, for example from
+  ///                 SRBranchRegistry::GetBranches(). Empty means all.
+  inline void WriteColumnarFile(TTree* tr, const std::string& fname,
+                                const std::set<std::string>& branches = {})
+  {
+    const std::set<std::string> needed = SRBranchRegistry::WithIndexFields(branches);
+
+    std::vector<TBranch*> cols;
+    TObjArray* brs = tr->GetListOfBranches();
+    for(int i = 0; i < brs->GetEntriesFast(); ++i){
+      TBranch* br = (TBranch*)brs->UncheckedAt(i);
+      if(branches.empty() || needed.count(br->GetName())) cols.push_back(br);
+    }
+
+    FILE* f = fopen(fname.c_str(), "wb");
+    if(!f){
+      std::cout << "WriteColumnarFile: unable to open '" << fname << "'" << std::endl;
+      abort();
+    }
+
+    const uint64_t N = tr->GetEntries();
+
+    columnar::FileHeader hdr;
+    memcpy(hdr.magic, columnar::kMagic, sizeof(columnar::kMagic));
+    hdr.nentries = N;
+    hdr.ncolumns = 0;
+    hdr.dirpos = 0;
+    fwrite(&hdr, sizeof(hdr), 1, f); // placeholder, rewritten at the end
+
+    std::vector<columnar::ColumnHeader> dir;
+    std::vector<std::string> names;
+
+    for(TBranch* br: cols){
+      TLeaf* leaf = br->GetLeaf(br->GetName());
+      const char code = leaf ? columnar::TypeCode(leaf) : 0;
+      if(!code){
+        std::cout << "WriteColumnarFile: skipping unsupported branch '" << br->GetName() << "'" << std::endl;
+        continue;
+      }
+      const int size = columnar::TypeSize(code);
+
+      columnar::ColumnHeader ch;
+      memset(&ch, 0, sizeof(ch));
+      ch.code = code;
+      ch.valuespos = columnar::Align(f);
+
+      std::vector<uint64_t> offsets;
+      offsets.reserve(N+1);
+      offsets.push_back(0);
+      for(uint64_t e = 0; e < N; ++e){
+        br->GetEntry(e);
+        const int n = leaf->GetLen();
+        fwrite(leaf->GetValuePointer(), size, n, f);
+        offsets.push_back(offsets.back()+n);
+      }
+
+      ch.nvalues = offsets.back();
+      ch.offsetspos = columnar::Align(f);
+      fwrite(offsets.data(), sizeof(uint64_t), offsets.size(), f);
+
+      ch.namelen = strlen(br->GetName());
+      dir.push_back(ch);
+      names.push_back(br->GetName());
+    }
+
+    hdr.ncolumns = dir.size();
+    hdr.dirpos = columnar::Align(f);
+    for(unsigned int i = 0; i < dir.size(); ++i){
+      fwrite(&dir[i], sizeof(dir[i]), 1, f);
+      const std::string padded = names[i] + std::string((8-names[i].size()%8)%8, '\0');
+      fwrite(padded.data(), 1, padded.size(), f);
+    }
+
+    fseek(f, 0, SEEK_SET);
+    fwrite(&hdr, sizeof(hdr), 1, f);
+    fclose(f);
+  }
+
+  /// \brief Convenience version, suitable for use from the ROOT prompt
+  ///
+  /// \param manifest Branch list as written by SRBranchRegistry::ToFile().
+  ///                 Empty means all branches.
+  inline void WriteColumnarFile(const std::string& inFile,
+                                const std::string& treeName,
+                                const std::string& outFile,
+                                const std::string& manifest = "")
+  {
+    TFile* fin = TFile::Open(inFile.c_str());
+    if(!fin || fin->IsZombie()){
+      std::cout << "WriteColumnarFile: unable to open '" << inFile << "'" << std::endl;
+      abort();
+    }
+
+    TTree* tr = 0;
+    fin->GetObject(treeName.c_str(), tr);
+    if(!tr){
+      std::cout << "WriteColumnarFile: no tree '" << treeName << "' in '" << inFile << "'" << std::endl;
+      abort();
+    }
+
+    std::set<std::string> branches;
+    if(!manifest.empty()){
+      std::ifstream fman(manifest);
+      std::string b;
+      while(fman >> b) branches.insert(b);
+    }
+
+    WriteColumnarFile(tr, outFile, branches);
+
+    delete fin;
+  }
+}
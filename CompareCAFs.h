@@ -0,0 +1,387 @@
+#pragma once
+
+#include "SRProxy/BasicTypesProxy.h"
+#include "SRProxy/ColumnarFile.h"
+#include "SRProxy/FlatConverter.h"
+#include "SRProxy/TempFile.h"
+
+#include "RVersion.h"
+#include "TBranch.h"
+#include "TFile.h"
+#include "TKey.h"
+#include "TLeaf.h"
+#include "TROOT.h"
+#include "TTree.h"
+
+#if ROOT_VERSION_CODE >= ROOT_VERSION(6,36,0)
+#include "SRProxy/NTupleFile.h"
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace caf
+{
+  /// How close floating-point values must be to count as equal. Integers
+  /// (and strings) must always match exactly, and NaN matches NaN.
+  struct CompareTolerance
+  {
+    double floatAbs = 0, floatRel = 0;
+    double doubleAbs = 0, doubleRel = 0;
+  };
+
+  /// Outcome of comparing one branch
+  struct BranchComparison
+  {
+    std::string name;
+    bool inA = true, inB = true;
+    long long nEntries = 0; ///< Entries compared
+    long long nDiffer = 0;  ///< Entries with any difference
+    long long firstDiff = -1;
+    double maxDiff = 0;     ///< Largest absolute difference seen
+  };
+
+  namespace compare
+  {
+    /// \brief One branch of one side, from whichever kind of file holds it
+    ///
+    /// As for the proxies, exactly one of the leaf, the mapped column and
+    /// the RNTuple column is set.
+    struct Column
+    {
+      TLeaf* leaf = 0;
+      const SRMappedColumn* mapped = 0;
+      const SRNTupleColumn* ntuple = 0;
+      char code = 0; ///< Leaflist type code, zero if not a number
+
+      /// Values of entry \a e, only for the columnar kinds
+      std::vector<double> vals;
+      std::vector<long long> ints;
+
+      bool IsFloat() const {return code == 'F' || code == 'D';}
+
+      /// Read entry \a e, returning its number of values
+      int Load(long long e)
+      {
+        if(leaf){
+          leaf->GetBranch()->GetEntry(e);
+          return leaf->GetLen();
+        }
+
+        vals.clear();
+        ints.clear();
+        for(int i = 0; ; ++i){
+          double x = 0;
+          long long n = 0;
+          const bool ok = IsFloat() ? Get(e, i, x) : Get(e, i, n);
+          if(!ok) break;
+          vals.push_back(x);
+          ints.push_back(n);
+        }
+        return vals.size();
+      }
+
+      double Value(int i) const {return leaf ? leaf->GetValue(i) : vals[i];}
+      long long Int(int i) const {return leaf ? leaf->GetTypedValue<long long>(i) : ints[i];}
+
+    protected:
+      template<class U> bool Get(long long e, int i, U& x) const
+      {
+        return mapped ? mapped->Get(e, i, x) : ntuple->Get(e, i, x);
+      }
+    };
+
+    /// The trees making up one side of the comparison, and which of them
+    /// holds each branch. Columnar files, and RNTuples with ROOT 6.36 or
+    /// later, are read through their SRMappedTree or SRNTupleTree.
+    struct Side
+    {
+      std::vector<std::unique_ptr<TFile>> files;
+      std::vector<std::unique_ptr<TTree>> owned;
+      std::vector<TTree*> trees;
+      std::map<std::string, int> branches;
+
+      Side(const std::vector<std::string>& fnames, const std::string& treeName)
+      {
+        if(fnames.empty()){
+          std::cout << "CompareCAFs: no files given" << std::endl;
+          abort();
+        }
+
+        for(const std::string& fname: fnames){
+          if(columnar::IsColumnarFile(fname)){
+            SRMappedTree* tr = new SRMappedTree(fname);
+            owned.emplace_back(tr);
+            Add(tr, tr->ColumnNames());
+            continue;
+          }
+
+          files.emplace_back(TFile::Open(fname.c_str()));
+          TTree* tr = 0;
+          if(files.back() && !files.back()->IsZombie()) files.back()->GetObject(treeName.c_str(), tr);
+
+#if ROOT_VERSION_CODE >= ROOT_VERSION(6,36,0)
+          TKey* key = (!tr && files.back()) ? files.back()->GetKey(treeName.c_str()) : 0;
+          if(key && key->GetClassName() == std::string("ROOT::RNTuple")){
+            SRNTupleTree* nt = new SRNTupleTree(fname, treeName);
+            owned.emplace_back(nt);
+            Add(nt, nt->ColumnNames());
+            continue;
+          }
+#endif
+
+          if(!tr){
+            std::cout << "CompareCAFs: no tree '" << treeName << "' in '" << fname << "'" << std::endl;
+            abort();
+          }
+
+          std::vector<std::string> names;
+          const TObjArray* brs = tr->GetListOfBranches();
+          for(int i = 0; i < brs->GetEntriesFast(); ++i) names.push_back(brs->UncheckedAt(i)->GetName());
+          Add(tr, names);
+        }
+      }
+
+      Column GetColumn(const std::string& name) const
+      {
+        TTree* tr = trees[branches.at(name)];
+        Column ret;
+        if(SRMappedTree* mt = dynamic_cast<SRMappedTree*>(tr)){
+          ret.mapped = mt->GetColumn(name);
+          ret.code = ret.mapped->code;
+        }
+        else if(SRNTupleTreeBase* nt = dynamic_cast<SRNTupleTreeBase*>(tr)){
+          ret.ntuple = nt->GetColumn(name);
+          ret.code = ret.ntuple->code;
+        }
+        else{
+          TBranch* br = tr->GetBranch(name.c_str());
+          ret.leaf = br->GetLeaf(br->GetName());
+          if(ret.leaf) ret.code = columnar::TypeCode(ret.leaf);
+        }
+        return ret;
+      }
+
+    protected:
+      void Add(TTree* tr, const std::vector<std::string>& names)
+      {
+        trees.push_back(tr);
+        // Split files repeat the index branches. Take the first.
+        for(const std::string& name: names) branches.emplace(name, trees.size()-1);
+      }
+    };
+
+    inline bool Close(double a, double b, double abs, double rel)
+    {
+      if(a == b || (std::isnan(a) && std::isnan(b))) return true;
+      return std::abs(a-b) <= std::max(abs, rel*std::max(std::abs(a), std::abs(b)));
+    }
+
+    /// Compare one branch over all entries
+    inline void CompareBranch(Column ca, Column cb, long long N,
+                              const CompareTolerance& tol,
+                              BranchComparison& res)
+    {
+      if(!ca.leaf && !ca.mapped && !ca.ntuple) return;
+      if(!cb.leaf && !cb.mapped && !cb.ntuple) return;
+
+      const bool isFloat = ca.code == 'F';
+      const bool isDouble = ca.code == 'D';
+
+      res.nEntries = N;
+
+      // Reading one branch at a time keeps each side streaming through its
+      // baskets in order
+      for(long long e = 0; e < N; ++e){
+        const int n = ca.Load(e);
+
+        bool differ = false;
+        if(n != cb.Load(e)){
+          differ = true;
+        }
+        else if(isFloat || isDouble){
+          const double abs = isFloat ? tol.floatAbs : tol.doubleAbs;
+          const double rel = isFloat ? tol.floatRel : tol.doubleRel;
+          for(int i = 0; i < n; ++i){
+            const double a = ca.Value(i);
+            const double b = cb.Value(i);
+            if(!Close(a, b, abs, rel)){
+              differ = true;
+              if(!std::isnan(a) && !std::isnan(b)) res.maxDiff = std::max(res.maxDiff, std::abs(a-b));
+            }
+          }
+        }
+        else{
+          for(int i = 0; i < n; ++i){
+            const long long a = ca.Int(i);
+            const long long b = cb.Int(i);
+            if(a != b){
+              differ = true;
+              res.maxDiff = std::max(res.maxDiff, std::abs(double(a)-double(b)));
+            }
+          }
+        }
+
+        if(differ){
+          if(res.nDiffer == 0) res.firstDiff = e;
+          ++res.nDiffer;
+        }
+      }
+    }
+
+    /// Nested files are flattened to a temporary file in \a tmpDir, so that
+    /// everything is compared in the same terms
+    template<class T> std::vector<std::string> AsFlat(const std::vector<std::string>& fnames,
+                                                      const std::string& treeName,
+                                                      const std::string& branchName,
+                                                      const std::string& tmpDir,
+                                                      const std::string& stem,
+                                                      SRTempFiles& tmps)
+    {
+      if(fnames.empty()){
+        std::cout << "CompareCAFs: no files given" << std::endl;
+        abort();
+      }
+
+      // Columnar files are always flat
+      if(columnar::IsColumnarFile(fnames[0])) return fnames;
+
+      TFile* f = TFile::Open(fnames[0].c_str());
+      TTree* tr = 0;
+      if(f && !f->IsZombie()) f->GetObject(treeName.c_str(), tr);
+      const bool nested = tr && GetCAFType(tr) == kNested;
+      delete f;
+      if(!nested) return fnames;
+
+      const std::string tmpName = tmps.Add(tmpDir+"/"+stem+"_");
+      flat::ConvertToFlat<T>(fnames, tmpName, treeName, branchName);
+      return {tmpName};
+    }
+  } // namespace compare
+
+  /// \brief Compare the flat CAFs \a a and \a b, branch by branch
+  ///
+  /// Each side is a list of files, so that the parts of a split file (see
+  /// flat::ConvertToFlat()) can be compared to a single file. Columnar files
+  /// (see WriteColumnarFile()) and RNTuples are read too. Branches are
+  /// shared out between \a nThreads threads (zero means one per core), and
+  /// all entries of each branch are compared in one pass.
+  ///
+  /// \return The comparison of every branch, in name order
+  inline std::vector<BranchComparison> CompareFlatCAFs(const std::vector<std::string>& a,
+                                                       const std::vector<std::string>& b,
+                                                       const std::string& treeName = "recTree",
+                                                       const CompareTolerance& tol = CompareTolerance(),
+                                                       unsigned int nThreads = 0)
+  {
+    ROOT::EnableThreadSafety();
+
+    std::vector<BranchComparison> ret;
+    long long N = 0;
+    {
+      const compare::Side sa(a, treeName), sb(b, treeName);
+      for(const auto& it: sa.branches){
+        ret.emplace_back();
+        ret.back().name = it.first;
+        ret.back().inB = sb.branches.count(it.first);
+      }
+      for(const auto& it: sb.branches){
+        if(sa.branches.count(it.first)) continue;
+        ret.emplace_back();
+        ret.back().name = it.first;
+        ret.back().inA = false;
+      }
+      std::sort(ret.begin(), ret.end(), [](const BranchComparison& x, const BranchComparison& y){return x.name < y.name;});
+
+      N = std::min(sa.trees[0]->GetEntries(), sb.trees[0]->GetEntries());
+      if(sa.trees[0]->GetEntries() != sb.trees[0]->GetEntries()){
+        std::cout << "CompareCAFs: different numbers of entries, " << sa.trees[0]->GetEntries()
+                  << " vs " << sb.trees[0]->GetEntries() << ". Comparing the first " << N << std::endl;
+      }
+    }
+
+    if(nThreads == 0) nThreads = std::max(1u, std::thread::hardware_concurrency());
+
+    std::atomic<unsigned int> next(0);
+    auto work = [&]()
+    {
+      // ROOT objects can't be shared between threads
+      const compare::Side sa(a, treeName), sb(b, treeName);
+      for(unsigned int i = next++; i < ret.size(); i = next++){
+        BranchComparison& res = ret[i];
+        if(!res.inA || !res.inB) continue;
+        compare::CompareBranch(sa.GetColumn(res.name), sb.GetColumn(res.name), N, tol, res);
+      }
+    };
+
+    std::vector<std::thread> threads;
+    for(unsigned int i = 0; i < nThreads; ++i) threads.emplace_back(work);
+    for(std::thread& t: threads) t.join();
+
+    return ret;
+  }
+
+  /// \brief Compact summary of the branches that differ
+  ///
+  /// \return true if all branches matched
+  inline bool PrintComparison(const std::vector<BranchComparison>& res, std::ostream& os = std::cout)
+  {
+    int nDiffer = 0, nOnlyA = 0, nOnlyB = 0;
+    for(const BranchComparison& r: res){
+      if(!r.inB){
+        ++nOnlyA;
+        os << "  " << std::left << std::setw(50) << r.name << " only in A" << std::endl;
+      }
+      else if(!r.inA){
+        ++nOnlyB;
+        os << "  " << std::left << std::setw(50) << r.name << " only in B" << std::endl;
+      }
+      else if(r.nDiffer > 0){
+        ++nDiffer;
+        os << "  " << std::left << std::setw(50) << r.name << " "
+           << r.nDiffer << "/" << r.nEntries << " entries differ, max |diff| "
+           << r.maxDiff << ", first at entry " << r.firstDiff << std::endl;
+      }
+    }
+
+    os << "Compared " << res.size() << " branches: " << nDiffer << " differ, "
+       << nOnlyA << " only in A, " << nOnlyB << " only in B" << std::endl;
+
+    return nDiffer == 0 && nOnlyA == 0 && nOnlyB == 0;
+  }
+
+  /// \brief Compare two CAFs, either of which may be nested or flat
+  ///
+  /// Nested inputs are first flattened to uniquely-named files in \a tmpDir,
+  /// and then everything is compared as flat. Prints a summary.
+  ///
+  /// \tparam T The record type, e.g. caf::StandardRecord. Its flat writer
+  ///           and dictionary are needed to flatten nested files
+  ///
+  /// \return true if the files match
+  template<class T> bool CompareCAFs(const std::vector<std::string>& a,
+                                     const std::vector<std::string>& b,
+                                     const std::string& treeName = "recTree",
+                                     const std::string& branchName = "rec",
+                                     const CompareTolerance& tol = CompareTolerance(),
+                                     unsigned int nThreads = 0,
+                                     const std::string& tmpDir = ".")
+  {
+    SRTempFiles tmps("CompareCAFs");
+    const std::vector<std::string> fa = compare::AsFlat<T>(a, treeName, branchName, tmpDir, "compare_a_flat", tmps);
+    const std::vector<std::string> fb = compare::AsFlat<T>(b, treeName, branchName, tmpDir, "compare_b_flat", tmps);
+
+    const bool ok = PrintComparison(CompareFlatCAFs(fa, fb, treeName, tol, nThreads));
+
+    return ok;
+  }
+}
@@ -0,0 +1,411 @@
+#pragma once
+
+#include "SRProxy/BasicTypesProxy.h"
+
+#include "TFile.h"
+#include "TLeaf.h"
+#include "TTree.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <queue>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace caf
+{
+  struct SREventID
+  {
+    uint32_t run;
+    uint32_t subrun;
+    uint32_t evt;
+
+    bool operator<(const SREventID& b) const
+    {
+      return std::tie(run, subrun, evt) < std::tie(b.run, b.subrun, b.evt);
+    }
+    bool operator==(const SREventID& b) const
+    {
+      return run == b.run && subrun == b.subrun && evt == b.evt;
+    }
+  };
+
+  /// Where an event is to be found
+  struct SREventLocation
+  {
+    SREventID id;
+    uint32_t file; ///< Index into SREventIndex::Files()
+    uint64_t entry;
+  };
+
+  namespace eventindex
+  {
+    const char kMagic[8] = {'S', 'R', 'P', 'X', 'E', 'V', 'I', '1'};
+
+    struct FileHeader
+    {
+      char magic[8];
+      uint64_t nfiles;
+      uint64_t nevents;
+      uint64_t eventspos; ///< Position of the sorted SREventLocation array
+    };
+
+    /// Events sorted in memory at once by BuildEventIndex(), 400MB worth
+    const size_t kRunSize = 1 << 24;
+
+    inline bool ByID(const SREventLocation& a, const SREventLocation& b)
+    {
+      return a.id < b.id;
+    }
+
+    /// The value of \a leaf at the loaded entry, which must fit an ID field
+    inline uint32_t IDValue(const TLeaf* leaf, const std::string& fname, long long entry)
+    {
+      const double v = leaf->GetValue();
+      if(!(v >= 0 && v <= UINT32_MAX) || v != uint32_t(v)){
+        std::cout << "BuildEventIndex: value " << v << " of '" << leaf->GetName()
+                  << "' in entry " << entry << " of '" << fname
+                  << "' is not a valid ID" << std::endl;
+        abort();
+      }
+      return uint32_t(v);
+    }
+
+    /// \brief Sorted runs of events, held in an anonymous temporary file
+    ///
+    /// Each run is read back through its own small buffer while they are
+    /// merged.
+    class RunFile
+    {
+    public:
+      RunFile(const std::string& near)
+      {
+        std::string name = near + ".tmpXXXXXX";
+        const int fd = mkstemp(name.data());
+        fFile = (fd >= 0) ? fdopen(fd, "w+b") : 0;
+        if(!fFile){
+          std::cout << "BuildEventIndex: unable to create a temporary file next to '" << near << "'" << std::endl;
+          abort();
+        }
+        unlink(name.c_str()); // gone when closed, however that happens
+      }
+
+      ~RunFile(){fclose(fFile);}
+
+      RunFile(const RunFile&) = delete;
+      RunFile& operator=(const RunFile&) = delete;
+
+      /// Sort \a evts and append them as a new run
+      void Add(std::vector<SREventLocation>& evts)
+      {
+        std::stable_sort(evts.begin(), evts.end(), ByID);
+        const uint64_t begin = fRuns.empty() ? 0 : fRuns.back().end;
+        fseek(fFile, begin*sizeof(SREventLocation), SEEK_SET);
+        if(fwrite(evts.data(), sizeof(SREventLocation), evts.size(), fFile) != evts.size()){
+          std::cout << "BuildEventIndex: unable to write a temporary file" << std::endl;
+          abort();
+        }
+        fRuns.push_back({begin, begin+evts.size(), {}, 0});
+        evts.clear();
+      }
+
+      bool Empty() const {return fRuns.empty();}
+
+      /// \brief Merge the runs into \a fout
+      ///
+      /// Ties go to the earlier run, so equal IDs stay in file order
+      void Merge(FILE* fout, size_t bufSize)
+      {
+        bufSize = std::max(bufSize/fRuns.size(), size_t(1024));
+
+        // Each run's current event is in the heap, smallest first
+        auto Later = [this](unsigned int a, unsigned int b){
+          const SREventID& ia = fRuns[a].Front().id;
+          const SREventID& ib = fRuns[b].Front().id;
+          return ib < ia || (ia == ib && b < a);
+        };
+        std::priority_queue<unsigned int, std::vector<unsigned int>, decltype(Later)> heap(Later);
+        for(unsigned int r = 0; r < fRuns.size(); ++r){
+          if(Refill(fRuns[r], bufSize)) heap.push(r);
+        }
+
+        while(!heap.empty()){
+          const unsigned int r = heap.top();
+          heap.pop();
+          fwrite(&fRuns[r].Front(), sizeof(SREventLocation), 1, fout);
+          if(++fRuns[r].pos < fRuns[r].buf.size() || Refill(fRuns[r], bufSize)) heap.push(r);
+        }
+      }
+
+    protected:
+      struct Run
+      {
+        uint64_t next, end; ///< Events not yet buffered, in the file
+        std::vector<SREventLocation> buf;
+        size_t pos;
+
+        const SREventLocation& Front() const {return buf[pos];}
+      };
+
+      /// Returns false once the run is exhausted
+      bool Refill(Run& run, size_t bufSize)
+      {
+        const size_t n = std::min(uint64_t(bufSize), run.end - run.next);
+        if(n == 0) return false;
+        run.buf.resize(n);
+        fseek(fFile, run.next*sizeof(SREventLocation), SEEK_SET);
+        if(fread(run.buf.data(), sizeof(SREventLocation), n, fFile) != n){
+          std::cout << "BuildEventIndex: unable to read a temporary file" << std::endl;
+          abort();
+        }
+        run.next += n;
+        run.pos = 0;
+        return true;
+      }
+
+      FILE* fFile;
+      std::vector<Run> fRuns;
+    };
+  }
+
+  /// \brief Build a sorted run/subrun/event index of flat CAFs \a fnames
+  ///
+  /// Written in native byte order, as a sidecar to be opened with
+  /// SREventIndex. Only the three ID branches are read.
+  ///
+  /// At most \a runSize events are held in memory. Beyond that they are
+  /// sorted in runs, in a temporary file next to \a indexName, which are
+  /// then merged.
+  inline void BuildEventIndex(const std::vector<std::string>& fnames,
+                              const std::string& indexName,
+                              const std::string& treeName = "recTree",
+                              const std::string& prefix = "rec.hdr",
+                              size_t runSize = eventindex::kRunSize)
+  {
+    std::vector<SREventLocation> evts;
+    std::unique_ptr<eventindex::RunFile> runs;
+    uint64_t nevents = 0;
+
+    for(unsigned int fileIdx = 0; fileIdx < fnames.size(); ++fileIdx){
+      std::unique_ptr<TFile> f(TFile::Open(fnames[fileIdx].c_str()));
+      TTree* tr = 0;
+      if(f && !f->IsZombie()) f->GetObject(treeName.c_str(), tr);
+      if(!tr){
+        std::cout << "BuildEventIndex: no tree '" << treeName << "' in '" << fnames[fileIdx] << "'" << std::endl;
+        abort();
+      }
+
+      TLeaf* leaves[3];
+      const std::string names[3] = {prefix+".run", prefix+".subrun", prefix+".evt"};
+      for(int i = 0; i < 3; ++i){
+        leaves[i] = tr->GetLeaf(names[i].c_str());
+        if(!leaves[i]){
+          std::cout << "BuildEventIndex: no branch '" << names[i] << "' in '" << fnames[fileIdx] << "'" << std::endl;
+          abort();
+        }
+      }
+
+      const long long N = tr->GetEntries();
+      for(long long e = 0; e < N; ++e){
+        for(TLeaf* leaf: leaves) leaf->GetBranch()->GetEntry(e);
+        evts.push_back({{eventindex::IDValue(leaves[0], fnames[fileIdx], e),
+                         eventindex::IDValue(leaves[1], fnames[fileIdx], e),
+                         eventindex::IDValue(leaves[2], fnames[fileIdx], e)},
+                        fileIdx, uint64_t(e)});
+        ++nevents;
+
+        if(evts.size() >= std::max(runSize, size_t(1))){
+          if(!runs) runs = std::make_unique<eventindex::RunFile>(indexName);
+          runs->Add(evts);
+        }
+      }
+    }
+
+    if(runs && !evts.empty()) runs->Add(evts);
+    // Duplicates stay in file order
+    if(!runs) std::stable_sort(evts.begin(), evts.end(), eventindex::ByID);
+
+    FILE* fout = fopen(indexName.c_str(), "wb");
+    if(!fout){
+      std::cout << "BuildEventIndex: unable to open '" << indexName << "'" << std::endl;
+      abort();
+    }
+
+    eventindex::FileHeader hdr;
+    memcpy(hdr.magic, eventindex::kMagic, sizeof(eventindex::kMagic));
+    hdr.nfiles = fnames.size();
+    hdr.nevents = nevents;
+    hdr.eventspos = 0;
+    fwrite(&hdr, sizeof(hdr), 1, fout); // placeholder, rewritten at the end
+
+    // File names, each with its trailing null
+    for(const std::string& fname: fnames) fwrite(fname.c_str(), 1, fname.size()+1, fout);
+
+    // Align the events so that they can be used in place
+    const long pos = ftell(fout);
+    const long pad = (8 - pos%8)%8;
+    const char zeros[8] = {};
+    fwrite(zeros, 1, pad, fout);
+    hdr.eventspos = pos+pad;
+
+    if(runs) runs->Merge(fout, runSize); else fwrite(evts.data(), sizeof(SREventLocation), evts.size(), fout);
+
+    fseek(fout, 0, SEEK_SET);
+    fwrite(&hdr, sizeof(hdr), 1, fout);
+    fclose(fout);
+  }
+
+  /// \brief A memory-mapped index written by BuildEventIndex()
+  ///
+  /// Lookups are binary searches of the mapping, so only the pages touched
+  /// are read, however large the index.
+  class SREventIndex
+  {
+  public:
+    SREventIndex(const std::string& fname)
+      : fData(0), fSize(0), fEvts(0), fN(0)
+    {
+      const int fd = open(fname.c_str(), O_RDONLY);
+      struct stat st;
+      if(fd < 0 || fstat(fd, &st) != 0){
+        std::cout << "SREventIndex: unable to open '" << fname << "'" << std::endl;
+        abort();
+      }
+      fSize = st.st_size;
+
+      void* data = mmap(0, fSize, PROT_READ, MAP_SHARED, fd, 0);
+      close(fd); // the mapping keeps the file alive
+      if(data == MAP_FAILED || fSize < sizeof(eventindex::FileHeader)){
+        std::cout << "SREventIndex: unable to map '" << fname << "'" << std::endl;
+        abort();
+      }
+      fData = (const char*)data;
+
+      const eventindex::FileHeader* hdr = (const eventindex::FileHeader*)fData;
+      if(memcmp(hdr->magic, eventindex::kMagic, sizeof(eventindex::kMagic)) != 0){
+        std::cout << "SREventIndex: '" << fname << "' is not an event index" << std::endl;
+        abort();
+      }
+
+      // Don't read beyond the mapping, whatever the header says
+      const char* pos = fData + sizeof(eventindex::FileHeader);
+      const char* end = fData + fSize;
+      for(uint64_t i = 0; i < hdr->nfiles; ++i){
+        const char* nul = (const char*)memchr(pos, 0, end-pos);
+        if(!nul) Corrupt(fname, "file names");
+        fFiles.emplace_back(pos, nul);
+        pos = nul+1;
+      }
+
+      if(hdr->eventspos%alignof(SREventLocation) != 0 || hdr->eventspos > fSize ||
+         hdr->nevents > (fSize - hdr->eventspos)/sizeof(SREventLocation)) Corrupt(fname, "events");
+
+      fEvts = (const SREventLocation*)(fData + hdr->eventspos);
+      fN = hdr->nevents;
+    }
+
+    ~SREventIndex()
+    {
+      if(fData) munmap((void*)fData, fSize);
+    }
+
+    SREventIndex(const SREventIndex&) = delete;
+    SREventIndex& operator=(const SREventIndex&) = delete;
+
+    const std::vector<std::string>& Files() const {return fFiles;}
+
+    /// All locations of \a id. Usually one, but may be none or several
+    std::vector<SREventLocation> Find(const SREventID& id) const
+    {
+      auto range = std::equal_range(fEvts, fEvts+fN, SREventLocation{id, 0, 0},
+                                    [](const SREventLocation& a, const SREventLocation& b){return a.id < b.id;});
+      return std::vector<SREventLocation>(range.first, range.second);
+    }
+
+    /// \brief All locations of \a ids, ordered by file and entry
+    ///
+    /// In this order each file is opened once, and entries sharing a
+    /// cluster are read one after another.
+    std::vector<SREventLocation> Find(const std::vector<SREventID>& ids) const
+    {
+      std::vector<SREventLocation> ret;
+      for(const SREventID& id: ids){
+        const std::vector<SREventLocation> locs = Find(id);
+        ret.insert(ret.end(), locs.begin(), locs.end());
+      }
+      std::sort(ret.begin(), ret.end(), [](const SREventLocation& a, const SREventLocation& b){
+          return std::tie(a.file, a.entry) < std::tie(b.file, b.entry);
+        });
+      // The same event requested twice is only visited once
+      ret.erase(std::unique(ret.begin(), ret.end(), [](const SREventLocation& a, const SREventLocation& b){
+            return a.file == b.file && a.entry == b.entry;
+          }), ret.end());
+      return ret;
+    }
+
+  protected:
+    static void Corrupt(const std::string& fname, const std::string& what)
+    {
+      std::cout << "SREventIndex: '" << fname << "' is truncated or corrupt (" << what << ")" << std::endl;
+      abort();
+    }
+
+    const char* fData;
+    size_t fSize;
+    std::vector<std::string> fFiles;
+    const SREventLocation* fEvts;
+    uint64_t fN;
+  };
+
+  /// \brief Visit the events \a ids, positioning a proxy tree at each in turn
+  ///
+  /// \tparam P Proxy type, e.g. caf::StandardRecordProxy. One is built for
+  ///           each file
+  /// \param func Called as func(P& sr, const SREventLocation& loc)
+  ///
+  /// \return The number of events visited. IDs missing from the index are
+  ///         skipped.
+  template<class P, class F> long PickEvents(const SREventIndex& index,
+                                             const std::vector<SREventID>& ids,
+                                             F func,
+                                             const std::string& treeName = "recTree",
+                                             const std::string& branchName = "rec")
+  {
+    const std::vector<SREventLocation> locs = index.Find(ids);
+
+    long nvisited = 0;
+    for(unsigned int i = 0; i < locs.size(); ){
+      const uint32_t fileIdx = locs[i].file;
+      const std::string& fname = index.Files()[fileIdx];
+
+      std::unique_ptr<TFile> f(TFile::Open(fname.c_str()));
+      TTree* tr = 0;
+      if(f && !f->IsZombie()) f->GetObject(treeName.c_str(), tr);
+      if(!tr){
+        std::cout << "PickEvents: no tree '" << treeName << "' in '" << fname << "'" << std::endl;
+        abort();
+      }
+
+      {
+        P sr(tr, branchName);
+        for(; i < locs.size() && locs[i].file == fileIdx; ++i){
+          tr->LoadTree(locs[i].entry);
+          func(sr, locs[i]);
+          ++nvisited;
+        }
+      }
+    }
+
+    return nvisited;
+  }
+}
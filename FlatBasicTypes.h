@@ -4,7 +4,11 @@
 
 #include "TTree.h"
 
+#include <cstdlib>
+#include <iostream>
+#include <limits>
 #include <string>
+#include <type_traits>
 #include <vector>
 
 namespace flat
@@ -39,15 +43,32 @@ namespace flat
 
   public:
     Flat(TTree* tr, const std::string& name, const std::string& totsize, const IBranchPolicy* policy)
-      : fBranch(0)
+      : fBranch(0), fNarrow(0)
     {
       if(policy && !policy->Include(name)) return;
 
       fData.emplace_back(); // needed to get an address
-      T* target = (T*)&fData.front();
+      void* target = &fData.front();
       fData.clear();
 
-      const char code = rootcode<typename FlatType<T>::type>::code;
+      std::string code(1, rootcode<typename FlatType<T>::type>::code);
+
+      const std::string enc = policy ? policy->Encoding(name) : "";
+      if(!enc.empty()){
+        if(!ValidEncoding(name, enc)){
+          std::cout << "flat::Flat: invalid encoding '" << enc << "' for '" << name << "'" << std::endl;
+          abort();
+        }
+        code = enc;
+
+        if(!std::is_floating_point_v<T>){
+          // Integers are stored in a separate buffer of the narrower type
+          fNarrow = enc[0];
+          fBytes.resize(sizeof(long long)); // needed to get an address
+          target = fBytes.data();
+          fBytes.clear();
+        }
+      }
 
       if(totsize.empty()){ // this branch is not an array
         fBranch = tr->Branch(name.c_str(), target, (name+"/"+code).c_str());
@@ -60,10 +81,21 @@ namespace flat
     void Clear()
     {
       fData.clear();
+      fBytes.clear();
     }
 
+    /// False if the policy excluded this branch
+    bool Enabled() const {return fBranch;}
+
     void Fill(const T& x)
     {
+      if(!fBranch) return; // excluded, don't bother storing the value
+
+      if(fNarrow){
+        FillNarrow(x);
+        return;
+      }
+
       const size_t oldcap = fData.capacity();
 
       fData.push_back(x);
@@ -77,8 +109,87 @@ namespace flat
     }
 
   protected:
+    static bool ValidEncoding(const std::string& name, const std::string& enc)
+    {
+      if constexpr(std::is_same_v<T, float>) return ValidTruncation(enc, 'f');
+      if constexpr(std::is_same_v<T, double>) return ValidTruncation(enc, 'd');
+      if constexpr(std::is_same_v<T, bool>) return false;
+
+      // ..length branches are the array dimensions of other branches, which
+      // ROOT needs to be Int_t
+      if(name.size() >= 8 && name.compare(name.size()-8, 8, "..length") == 0) return false;
+      return enc.size() == 1 && std::string("BbSsIi").find(enc[0]) != std::string::npos;
+    }
+
+    /// \a code alone, or followed by [min,max] or [min,max,nbits], as ROOT
+    /// accepts for Float16_t and Double32_t
+    static bool ValidTruncation(const std::string& enc, char code)
+    {
+      if(enc.empty() || enc[0] != code) return false;
+      if(enc.size() == 1) return true;
+      if(enc[1] != '[' || enc.back() != ']') return false;
+
+      std::vector<double> args;
+      const char* p = enc.c_str()+2;
+      while(true){
+        char* end;
+        args.push_back(strtod(p, &end));
+        if(end == p) return false; // not a number
+        if(*end == ']' && end == enc.c_str()+enc.size()-1) break;
+        if(*end != ',') return false;
+        p = end+1;
+      }
+
+      if(args.size() != 2 && args.size() != 3) return false;
+      // [0,0] means only the mantissa is truncated
+      if(args[0] > args[1] || (args[0] == args[1] && args[0] != 0)) return false;
+      if(args.size() == 3 && (args[2] != int(args[2]) || args[2] < 2 || args[2] > 32)) return false;
+      return true;
+    }
+
+    /// Whether \a x is exactly representable as a \a V
+    template<class V> static bool Fits(const T& x)
+    {
+      using W = typename std::conditional_t<std::is_enum_v<T>, std::underlying_type<T>, std::common_type<T>>::type;
+      const W w = W(x);
+      if constexpr(std::is_signed_v<W>){
+        if(w < 0) return std::is_signed_v<V> && (long long)w >= (long long)std::numeric_limits<V>::min();
+      }
+      return (unsigned long long)w <= (unsigned long long)std::numeric_limits<V>::max();
+    }
+
+    template<class V> void Push(const T& x)
+    {
+      if(!Fits<V>(x)){
+        std::cout << "flat::Flat: value " << +typename FlatType<T>::type(x) << " of '" << fBranch->GetName()
+                  << "' doesn't fit its encoding '" << fNarrow << "'" << std::endl;
+        abort();
+      }
+
+      const V v = V(x);
+      const size_t oldcap = fBytes.capacity();
+      fBytes.insert(fBytes.end(), (const char*)&v, (const char*)&v+sizeof(V));
+      if(fBytes.capacity() != oldcap) fBranch->SetAddress(fBytes.data());
+    }
+
+    void FillNarrow(const T& x)
+    {
+      switch(fNarrow){
+      case 'B': Push<char>(x); break;
+      case 'b': Push<unsigned char>(x); break;
+      case 'S': Push<short>(x); break;
+      case 's': Push<unsigned short>(x); break;
+      case 'I': Push<int>(x); break;
+      case 'i': Push<unsigned int>(x); break;
+      default: abort();
+      }
+    }
+
     TBranch* fBranch;
     std::vector<typename FlatType<T>::type> fData;
+
+    char fNarrow; ///< Leaflist code of a narrowed integer, or zero
+    std::vector<char> fBytes; ///< Values when fNarrow is set
   };
 
   template<class T> class Flat<std::vector<T>>
@@ -90,8 +201,9 @@ namespace flat
       fTotArraySize(0),
       fData(tr, SubName(name), SubLengthName(tr, name, totsize), policy)
     {
-      // Would always be zero if this vector was not nested inside any others
-      if(!totsize.empty()){
+      // Would always be zero if this vector was not nested inside any others.
+      // Otherwise, the reader may be able to rebuild it from fLength.
+      if(!totsize.empty() && !(policy && policy->DeriveIndices())){
         fIdx = new Flat<int>(tr, name+"..idx", totsize, policy);
       }
     }
@@ -109,9 +221,20 @@ namespace flat
       fData.Clear();
     }
 
+    /// \brief False if the policy excluded all our branches
+    ///
+    /// The ..totarraysize branch doesn't count, it only exists to size the
+    /// others
+    bool Enabled() const
+    {
+      return fLength.Enabled() || (fIdx && fIdx->Enabled()) || fData.Enabled();
+    }
+
     void Fill(const std::vector<T>& xs)
     {
-      for(const T& x: xs) fData.Fill(x);
+      if(fData.Enabled()){
+        for(const T& x: xs) fData.Fill(x);
+      }
       fLength.Fill(xs.size());
       if(fIdx) fIdx->Fill(fTotArraySize);
       fTotArraySize += xs.size();
@@ -171,9 +294,16 @@ namespace flat
       fData.Clear();
     }
 
+    bool Enabled() const
+    {
+      return (fIdx && fIdx->Enabled()) || fData.Enabled();
+    }
+
     void Fill(const T* xs)
     {
-      for(int i = 0; i < N; ++i) fData.Fill(xs[i]);
+      if(fData.Enabled()){
+        for(int i = 0; i < N; ++i) fData.Fill(xs[i]);
+      }
       if(fIdx) fIdx->Fill(fTotArraySize);
       fTotArraySize += N;
     }
@@ -228,6 +358,12 @@ namespace flat
       for(Flat<T>* d: fData) d->Clear();
     }
 
+    bool Enabled() const
+    {
+      for(const Flat<T>* d: fData) if(d->Enabled()) return true;
+      return false;
+    }
+
     void Fill(const T* xs)
     {
       for(unsigned int i = 0; i < N; ++i) fData[i]->Fill(xs[i]);
@@ -242,7 +378,9 @@ namespace flat
   /// Inline arrays are easier to access in some contexts, and don't require
   /// cross-referencing indices, but can become unweildy with particularly
   /// large arrays. Arrays up to an including this size will be represented
-  /// inline, while larger arrays will mimic the layout of vectors.
+  /// inline, while larger arrays will mimic the layout of vectors. The
+  /// proxies' column IDs (caf::kMaxInlineArraySize, and gen_srproxy) follow
+  /// the same rule.
   static const int kMaxInlineSize = 16;
 
   /// Figure out the class arrays of a particular size should be implemented by
@@ -264,6 +402,7 @@ namespace flat
 
     void Fill(const std::string& x)
     {
+      if(!Enabled()) return; // don't even make the copy
       Flat<std::vector<char>>::Fill(std::vector<char>(x.c_str(), x.c_str()+x.size()+1)); // deliberately include the trailing null
     }
   };
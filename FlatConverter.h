@@ -0,0 +1,170 @@
+#pragma once
+
+#include "SRProxy/FlatBasicTypes.h"
+#include "SRProxy/IBranchPolicy.h"
+#include "SRProxy/ManifestPolicy.h"
+#include "SRProxy/TempFile.h"
+#include "SRProxy/ZoneMap.h"
+
+#include "TChain.h"
+#include "TFile.h"
+#include "TFileMerger.h"
+#include "TROOT.h"
+#include "TTree.h"
+
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace flat
+{
+  /// Build the zone map of \a fname for the branches \a policy asks for
+  inline void WriteZoneMap(const std::string& fname, const IBranchPolicy& policy, const std::string& treeName)
+  {
+    std::vector<std::string> branches;
+    {
+      std::unique_ptr<TFile> f(TFile::Open(fname.c_str()));
+      TTree* tr = 0;
+      if(f && !f->IsZombie()) f->GetObject(treeName.c_str(), tr);
+      if(!tr) return;
+
+      const TObjArray* brs = tr->GetListOfBranches();
+      for(int i = 0; i < brs->GetEntriesFast(); ++i){
+        const std::string name = brs->UncheckedAt(i)->GetName();
+        if(policy.ZoneMap(name)) branches.push_back(name);
+      }
+    }
+
+    if(!branches.empty()) caf::BuildZoneMap(fname, branches, treeName);
+  }
+
+  /// \brief Convert nested CAFs to flat CAFs, split across several files
+  ///
+  /// Each output receives the leaves its policy includes, so for example a
+  /// pair of ManifestPolicy objects gives a small "hot" file and a large
+  /// "cold" one. They all have the same entries, in the same order, and can
+  /// be read together as friend trees, see caf::AddFlatFriends().
+  ///
+  /// The entries are split into \a nThreads contiguous ranges, each of which
+  /// is flattened into its own uniquely-named temporary files alongside the
+  /// outputs, which are removed even if the conversion fails. These are then
+  /// concatenated, in order, so the output entries are in the same order as
+  /// the input. Finally, any zone maps the policies ask for (see
+  /// IBranchPolicy::ZoneMap()) are recorded.
+  ///
+  /// \tparam T The nested record type, e.g. caf::StandardRecord. Its flat
+  ///           writer (from gen_srproxy --flat) and dictionary must be loaded
+  ///
+  /// \param inFiles    Nested CAFs, in order. Wildcards are accepted
+  /// \param outputs    File name and policy of each output. A null policy
+  ///                   means all leaves
+  /// \param treeName   Tree in the input files, and name of the output trees
+  /// \param branchName Branch holding the record, and prefix of the flat
+  ///                   branches
+  /// \param nThreads   Zero means one per core
+  template<class T> void ConvertToFlat(const std::vector<std::string>& inFiles,
+                                       const std::vector<std::pair<std::string, const IBranchPolicy*>>& outputs,
+                                       const std::string& treeName = "recTree",
+                                       const std::string& branchName = "rec",
+                                       unsigned int nThreads = 0)
+  {
+    ROOT::EnableThreadSafety();
+
+    TChain counter(treeName.c_str());
+    for(const std::string& f: inFiles) counter.Add(f.c_str());
+    const long long N = counter.GetEntries();
+
+    if(nThreads == 0) nThreads = std::max(1u, std::thread::hardware_concurrency());
+    // Don't leave threads with nothing to do
+    if(nThreads > N) nThreads = std::max(1ll, N);
+
+    const unsigned int nOut = outputs.size();
+
+    // parts[out][thread]
+    caf::SRTempFiles tmps("ConvertToFlat");
+    std::vector<std::vector<std::string>> parts(nOut);
+    for(unsigned int o = 0; o < nOut; ++o){
+      for(unsigned int i = 0; i < nThreads; ++i)
+        parts[o].push_back(tmps.Add(outputs[o].first+".part"+std::to_string(i)+"_"));
+    }
+
+    auto convert = [&](unsigned int part)
+    {
+      const long long begin = N*part/nThreads;
+      const long long end = N*(part+1)/nThreads;
+
+      // ROOT objects can't be shared between threads, so each part has its
+      // own chain
+      TChain ch(treeName.c_str());
+      for(const std::string& f: inFiles) ch.Add(f.c_str());
+
+      T* rec = 0;
+      ch.SetBranchAddress(branchName.c_str(), &rec);
+
+      std::vector<std::unique_ptr<TFile>> fouts;
+      std::vector<TTree*> trees;
+      std::vector<std::unique_ptr<Flat<T>>> flats;
+      for(unsigned int o = 0; o < nOut; ++o){
+        fouts.emplace_back(new TFile(parts[o][part].c_str(), "RECREATE"));
+        if(fouts.back()->IsZombie()) tmps.Fail("unable to open '"+parts[o][part]+"'");
+        trees.push_back(new TTree(treeName.c_str(), treeName.c_str()));
+        flats.emplace_back(new Flat<T>(trees.back(), branchName, "", outputs[o].second));
+      }
+
+      for(long long i = begin; i < end; ++i){
+        if(ch.GetEntry(i) <= 0) tmps.Fail("failed to read entry "+std::to_string(i));
+
+        for(unsigned int o = 0; o < nOut; ++o){
+          flats[o]->Clear();
+          flats[o]->Fill(*rec);
+          trees[o]->Fill();
+        }
+      }
+
+      flats.clear(); // must go before the files delete the trees
+
+      for(unsigned int o = 0; o < nOut; ++o){
+        fouts[o]->cd();
+        trees[o]->Write();
+        fouts[o]->Close();
+      }
+    };
+
+    std::vector<std::thread> threads;
+    for(unsigned int i = 0; i < nThreads; ++i) threads.emplace_back(convert, i);
+    for(std::thread& t: threads) t.join();
+
+    for(unsigned int o = 0; o < nOut; ++o){
+      const std::string& outFile = outputs[o].first;
+
+      // The fast method copies the compressed baskets without unpacking them
+      TFileMerger merger(false, false);
+      merger.SetFastMethod(true);
+      merger.SetPrintLevel(0);
+      if(!merger.OutputFile(outFile.c_str(), "RECREATE")) tmps.Fail("unable to open '"+outFile+"'");
+      for(const std::string& p: parts[o]) merger.AddFile(p.c_str(), false);
+      if(!merger.Merge()) tmps.Fail("failed to merge into '"+outFile+"'");
+
+      for(const std::string& p: parts[o]) tmps.Remove(p);
+
+      // The clusters are only final once merged
+      if(outputs[o].second) WriteZoneMap(outFile, *outputs[o].second, treeName);
+    }
+  }
+
+  /// \brief Convert nested CAFs to a single flat CAF
+  ///
+  /// \param policy Which leaves to write. Null means all
+  template<class T> void ConvertToFlat(const std::vector<std::string>& inFiles,
+                                       const std::string& outFile,
+                                       const std::string& treeName = "recTree",
+                                       const std::string& branchName = "rec",
+                                       const IBranchPolicy* policy = 0,
+                                       unsigned int nThreads = 0)
+  {
+    ConvertToFlat<T>(inFiles, {{outFile, policy}}, treeName, branchName, nThreads);
+  }
+}
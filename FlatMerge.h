@@ -0,0 +1,310 @@
+#pragma once
+
+#include "SRProxy/TempFile.h"
+#include "SRProxy/ZoneMap.h"
+
+#include "TBranch.h"
+#include "TChain.h"
+#include "TFile.h"
+#include "TFileMerger.h"
+#include "TKey.h"
+#include "TLeaf.h"
+#include "TTree.h"
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace flat
+{
+  struct FlatMergeOptions
+  {
+    /// Give files that lack some branches default values (zero, or empty
+    /// arrays) for them. Otherwise the branch sets must match exactly
+    bool fillMissing = true;
+
+    /// \brief Rewrite the output with new, larger clusters
+    ///
+    /// Small inputs otherwise keep their small clusters. This has to
+    /// decompress and recompress everything, so it is no longer just a copy.
+    bool recluster = false;
+    /// Target cluster size when reclustering. Zero means ROOT's default
+    long long clusterBytes = 0;
+  };
+
+  namespace merge
+  {
+    /// What's needed to recreate a branch that a file is missing
+    struct BranchDesc
+    {
+      std::string leaflist; ///< The branch title, e.g. "a.b[a..length]/F"
+      std::string count;    ///< Leaf holding the array size, or empty
+      int typeSize;
+    };
+
+    /// The branches of \a tr, in order
+    inline std::vector<std::pair<std::string, BranchDesc>> Describe(TTree* tr)
+    {
+      std::vector<std::pair<std::string, BranchDesc>> ret;
+      const TObjArray* brs = tr->GetListOfBranches();
+      for(int i = 0; i < brs->GetEntriesFast(); ++i){
+        TBranch* br = (TBranch*)brs->UncheckedAt(i);
+        TLeaf* leaf = br->GetLeaf(br->GetName());
+        if(!leaf) continue;
+        ret.push_back({br->GetName(),
+                       {br->GetTitle(),
+                        leaf->GetLeafCount() ? leaf->GetLeafCount()->GetName() : "",
+                        leaf->GetLenType()}});
+      }
+      return ret;
+    }
+
+    inline TTree* OpenTree(TFile* f, const std::string& fname, const std::string& treeName)
+    {
+      TTree* tr = 0;
+      if(f && !f->IsZombie()) f->GetObject(treeName.c_str(), tr);
+      if(!tr){
+        std::cout << "MergeFlatCAFs: no tree '" << treeName << "' in '" << fname << "'" << std::endl;
+        abort();
+      }
+      return tr;
+    }
+
+    /// \brief Copy the top-level objects of \a fin, other than \a skip, to
+    /// \a fout
+    ///
+    /// Only the latest cycle of each is copied. Directories are skipped with
+    /// a warning.
+    inline void CopyKeys(TFile* fin, TFile* fout, std::set<std::string> skip)
+    {
+      // Keys are listed newest cycle first
+      for(TObject* obj: *fin->GetListOfKeys()){
+        TKey* key = (TKey*)obj;
+        if(!skip.insert(key->GetName()).second) continue;
+        TObject* o = key->ReadObj();
+        if(o->InheritsFrom("TDirectory")){
+          std::cout << "flat::merge: not copying directory '" << key->GetName() << "'" << std::endl;
+          continue;
+        }
+        fout->cd();
+        if(o->InheritsFrom("TTree")){
+          // Writing the tree itself would only write its header, still
+          // pointing at baskets in fin
+          TTree* clone = ((TTree*)o)->CloneTree(-1, "fast");
+          clone->Write(key->GetName());
+        }
+        else{
+          o->Write(key->GetName());
+        }
+      }
+    }
+
+    /// Store \a v at \a p as the integer type of leaflist \a code
+    inline void StoreInt(char* p, char code, long v)
+    {
+      switch(code){
+      case 'B': *(char*)p = v; break;
+      case 'b': *(unsigned char*)p = v; break;
+      case 'S': *(short*)p = v; break;
+      case 's': *(unsigned short*)p = v; break;
+      case 'I': *(int*)p = v; break;
+      case 'i': *(unsigned int*)p = v; break;
+      default: abort();
+      }
+    }
+
+    /// \brief Copy \a in to \a out, adding the branches in \a missing
+    ///
+    /// The existing branches are copied basket by basket. The new ones are
+    /// all zeros, with as many values per entry as their count leaf says,
+    /// which is zero if that is missing too. The exception is a ..idx field
+    /// whose ..length is present, written with IBranchPolicy::DeriveIndices(),
+    /// which is rebuilt as the running sum of the lengths. Readers trust an
+    /// index that is there, so zeros would point every sub-vector at the
+    /// start. Other objects in the file are copied too.
+    inline void Pad(const std::string& in, const std::string& out, const std::string& treeName,
+                    const std::vector<std::pair<std::string, BranchDesc>>& missing)
+    {
+      std::unique_ptr<TFile> fin(TFile::Open(in.c_str()));
+      TTree* tr = OpenTree(fin.get(), in, treeName);
+
+      std::unique_ptr<TFile> fout(new TFile(out.c_str(), "RECREATE"));
+      if(fout->IsZombie()){
+        std::cout << "MergeFlatCAFs: unable to open '" << out << "'" << std::endl;
+        abort();
+      }
+      TTree* tout = tr->CloneTree(-1, "fast");
+
+      struct NewBranch
+      {
+        TBranch* br;
+        bool isArray;
+        TLeaf* count; ///< in the input tree, if there
+        TLeaf* lengths; ///< ..length matching a ..idx, if there
+        char code;
+        int typeSize;
+        std::vector<char> buf;
+      };
+      std::vector<NewBranch> news;
+      for(const auto& m: missing){
+        NewBranch nb;
+        nb.isArray = !m.second.count.empty();
+        nb.count = nb.isArray ? tr->GetLeaf(m.second.count.c_str()) : 0;
+        nb.lengths = 0;
+        const std::string idx = "..idx";
+        if(m.first.size() > idx.size() && m.first.compare(m.first.size()-idx.size(), idx.size(), idx) == 0){
+          const std::string len = m.first.substr(0, m.first.size()-idx.size())+"..length";
+          nb.lengths = tr->GetLeaf(len.c_str());
+        }
+        nb.code = m.second.leaflist.back();
+        nb.typeSize = m.second.typeSize;
+        nb.buf.resize(nb.typeSize);
+        nb.br = tout->Branch(m.first.c_str(), nb.buf.data(), m.second.leaflist.c_str());
+        news.push_back(std::move(nb));
+      }
+
+      const long long N = tr->GetEntries();
+      for(long long e = 0; e < N; ++e){
+        for(NewBranch& nb: news){
+          int n = 1;
+          if(nb.count){
+            nb.count->GetBranch()->GetEntry(e);
+            n = int(nb.count->GetValue());
+          }
+          else if(nb.isArray){
+            n = 0; // the count is being added too
+          }
+          // Never empty, so there is always an address to give
+          nb.buf.assign(std::max(n, 1)*nb.typeSize, 0);
+          if(nb.lengths){
+            nb.lengths->GetBranch()->GetEntry(e);
+            long sum = 0;
+            for(int i = 0; i < n; ++i){
+              StoreInt(nb.buf.data()+i*nb.typeSize, nb.code, sum);
+              sum += long(nb.lengths->GetValue(i));
+            }
+          }
+          nb.br->SetAddress(nb.buf.data());
+          nb.br->Fill();
+        }
+      }
+
+      fout->cd();
+      tout->Write();
+      // So that they are still merged, e.g. exposure histograms
+      CopyKeys(fin.get(), fout.get(), {treeName});
+      fout->Close();
+    }
+  } // namespace merge
+
+  /// \brief Concatenate flat CAFs, copying the compressed baskets as they are
+  ///
+  /// Since ..idx fields count from the start of each entry, the baskets of
+  /// flat files can be concatenated verbatim, and merging is limited by I/O
+  /// rather than decompression. All branches must have the same type in
+  /// every file. Files missing some branches are first padded with defaults
+  /// (see FlatMergeOptions), which only rewrites the new branches. Other
+  /// objects in the files, e.g. exposure histograms, are merged as hadd
+  /// would, and the zone maps (see caf::SRZoneMap) are rebuilt for the new
+  /// clusters. Padded and reclustered copies go in uniquely-named temporary
+  /// files next to \a outFile (see caf::SRTempFiles).
+  inline void MergeFlatCAFs(const std::vector<std::string>& inFiles,
+                            const std::string& outFile,
+                            const std::string& treeName = "recTree",
+                            const FlatMergeOptions& opts = FlatMergeOptions())
+  {
+    // The union of all the branches, in the order first seen
+    std::vector<std::pair<std::string, merge::BranchDesc>> all;
+    std::map<std::string, unsigned int> allIdx;
+    std::vector<std::set<std::string>> present(inFiles.size());
+    std::set<std::string> zoneBranches;
+
+    for(unsigned int i = 0; i < inFiles.size(); ++i){
+      {
+        std::unique_ptr<TFile> f(TFile::Open(inFiles[i].c_str()));
+        TTree* tr = merge::OpenTree(f.get(), inFiles[i], treeName);
+
+        for(const auto& b: merge::Describe(tr)){
+          present[i].insert(b.first);
+          auto it = allIdx.find(b.first);
+          if(it == allIdx.end()){
+            allIdx[b.first] = all.size();
+            all.push_back(b);
+          }
+          else if(all[it->second].second.leaflist != b.second.leaflist){
+            std::cout << "MergeFlatCAFs: branch '" << b.first << "' is '"
+                      << all[it->second].second.leaflist << "' in '" << inFiles[0]
+                      << "' but '" << b.second.leaflist << "' in '" << inFiles[i]
+                      << "'" << std::endl;
+            abort();
+          }
+        }
+      }
+
+      const caf::SRZoneMap zm(inFiles[i], treeName);
+      for(const std::string& b: zm.Branches()) zoneBranches.insert(b);
+    }
+
+    // Pad any files that need it
+    std::vector<std::string> parts = inFiles;
+    caf::SRTempFiles tmps("MergeFlatCAFs");
+    for(unsigned int i = 0; i < inFiles.size(); ++i){
+      std::vector<std::pair<std::string, merge::BranchDesc>> missing;
+      for(const auto& b: all) if(!present[i].count(b.first)) missing.push_back(b);
+      if(missing.empty()) continue;
+
+      if(!opts.fillMissing){
+        tmps.Fail("'"+inFiles[i]+"' lacks "+std::to_string(missing.size())+
+                  " branches, e.g. '"+missing[0].first+"'");
+      }
+
+      parts[i] = tmps.Add(outFile+".pad"+std::to_string(i)+"_");
+      merge::Pad(inFiles[i], parts[i], treeName, missing);
+    }
+
+    const std::string zmName = caf::zonemap::TreeName(treeName);
+
+    // The fast method copies the compressed baskets without unpacking them
+    const std::string merged = opts.recluster ? tmps.Add(outFile+".merged_") : outFile;
+
+    TFileMerger merger(false, false);
+    merger.SetFastMethod(true);
+    merger.SetPrintLevel(0);
+    if(!merger.OutputFile(merged.c_str(), "RECREATE")) tmps.Fail("unable to open '"+merged+"'");
+    for(const std::string& p: parts) merger.AddFile(p.c_str(), false);
+    // Entry numbers in the zone maps are per-file. Rebuilt below
+    merger.AddObjectNames(zmName.c_str());
+    if(!merger.PartialMerge(TFileMerger::kAll | TFileMerger::kRegular | TFileMerger::kSkipListed)){
+      tmps.Fail("failed to merge into '"+merged+"'");
+    }
+
+    if(opts.recluster){
+      std::unique_ptr<TFile> fin(TFile::Open(merged.c_str()));
+      TTree* tr = merge::OpenTree(fin.get(), merged, treeName);
+
+      std::unique_ptr<TFile> fout(new TFile(outFile.c_str(), "RECREATE"));
+      if(fout->IsZombie()) tmps.Fail("unable to open '"+outFile+"'");
+
+      TTree* tout = tr->CloneTree(0);
+      // Otherwise the clone would inherit the small inputs' setting. 30MB is
+      // ROOT's default
+      tout->SetAutoFlush(opts.clusterBytes > 0 ? -opts.clusterBytes : -30000000);
+      tout->CopyEntries(tr);
+      tout->Write();
+
+      merge::CopyKeys(fin.get(), fout.get(), {treeName});
+
+      fout->Close();
+    }
+
+    tmps.Remove();
+
+    if(!zoneBranches.empty()){
+      caf::BuildZoneMap(outFile, std::vector<std::string>(zoneBranches.begin(), zoneBranches.end()), treeName);
+    }
+  }
+}
@@ -0,0 +1,176 @@
+#pragma once
+
+#include "SRProxy/FlatMerge.h"
+#include "SRProxy/ZoneMap.h"
+
+#include "TBranch.h"
+#include "TFile.h"
+#include "TLeaf.h"
+#include "TTree.h"
+#include "TTreeFormula.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace flat
+{
+  struct FlatSortOptions
+  {
+    /// \brief Entries sorted together
+    ///
+    /// Each window is held in memory, uncompressed, while it is reordered.
+    /// Zero means the whole file at once.
+    long long window = 100000;
+
+    /// Holds the original entry number of each output entry, so that the
+    /// original order can be recovered, e.g. with TTree::BuildIndex().
+    std::string entryBranch = "orig_entry";
+  };
+
+  namespace sort
+  {
+    /// The values of one branch over one window
+    struct Column
+    {
+      TBranch* in;
+      TLeaf* leaf;
+      int typeSize;
+      std::vector<char> data;
+      std::vector<size_t> offsets; ///< Into data, one per entry plus one
+      std::vector<char> buf; ///< The output branch reads from here
+      TBranch* out;
+    };
+  }
+
+  /// \brief Rewrite the flat CAF \a inFile with its entries sorted by \a key
+  ///
+  /// CAF-makers write entries in reconstruction order, which interleaves
+  /// very different events. Grouping similar ones, e.g. by category or
+  /// binned energy, makes the baskets more uniform. They compress better,
+  /// and the clusters' ranges in the zone maps (see caf::SRZoneMap) become
+  /// narrow enough to skip.
+  ///
+  /// The entries are sorted within each window of FlatSortOptions::window
+  /// entries, which is read a branch at a time, in order. Ties stay in
+  /// their original order, as do entries that have no value of \a key,
+  /// which go last. Other objects in the file are copied, and zone maps
+  /// are rebuilt for the new clusters.
+  ///
+  /// \param key A TTreeFormula expression, e.g. "rec.hdr.category" or
+  ///            "int(rec.slc.energy[0]/0.25)". Its first value in each entry
+  ///            is used
+  inline void SortFlatCAF(const std::string& inFile,
+                          const std::string& outFile,
+                          const std::string& key,
+                          const std::string& treeName = "recTree",
+                          const FlatSortOptions& opts = FlatSortOptions())
+  {
+    std::unique_ptr<TFile> fin(TFile::Open(inFile.c_str()));
+    TTree* tr = merge::OpenTree(fin.get(), inFile, treeName);
+    const long long N = tr->GetEntries();
+
+    // The keys are small, so compute them all up front
+    std::vector<double> keys(N);
+    {
+      TTreeFormula ttf("srproxy_sort_key", key.c_str(), tr);
+      if(ttf.GetNdim() == 0){
+        std::cout << "SortFlatCAF: unable to evaluate '" << key << "' on '" << inFile << "'" << std::endl;
+        abort();
+      }
+      for(long long e = 0; e < N; ++e){
+        tr->LoadTree(e);
+        keys[e] = (ttf.GetNdata() > 0) ? ttf.EvalInstance(0) : std::numeric_limits<double>::infinity();
+        // NaNs can't be ordered, so treat them as missing
+        if(std::isnan(keys[e])) keys[e] = std::numeric_limits<double>::infinity();
+      }
+    }
+
+    // Each branch is read through a window on its own, below, which the
+    // cache (prefetching every branch of a cluster) would only get in the
+    // way of
+    tr->SetCacheSize(0);
+
+    std::unique_ptr<TFile> fout(new TFile(outFile.c_str(), "RECREATE", "", fin->GetCompressionSettings()));
+    if(fout->IsZombie()){
+      std::cout << "SortFlatCAF: unable to open '" << outFile << "'" << std::endl;
+      abort();
+    }
+    TTree* tout = new TTree(treeName.c_str(), tr->GetTitle());
+
+    std::vector<sort::Column> cols;
+    bool hasOrig = false;
+    for(const auto& b: merge::Describe(tr)){
+      // A file sorted before already knows its original order, and its
+      // permutation column is carried along like any other
+      if(b.first == opts.entryBranch) hasOrig = true;
+      sort::Column c;
+      c.in = tr->GetBranch(b.first.c_str());
+      c.leaf = c.in->GetLeaf(b.first.c_str());
+      c.typeSize = b.second.typeSize;
+      c.buf.resize(std::max(c.leaf->GetLenStatic(), 1)*c.typeSize);
+      // The branches that count the others come first, as in the input
+      c.out = tout->Branch(b.first.c_str(), c.buf.data(), b.second.leaflist.c_str());
+      cols.push_back(std::move(c));
+    }
+
+    long long orig;
+    if(!hasOrig) tout->Branch(opts.entryBranch.c_str(), &orig, (opts.entryBranch+"/L").c_str());
+
+    const long long window = (opts.window > 0) ? opts.window : std::max(N, 1ll);
+    std::vector<long long> perm;
+
+    for(long long begin = 0; begin < N; begin += window){
+      const long long end = std::min(begin+window, N);
+
+      // Branch by branch, so that each streams through its baskets in order
+      for(sort::Column& c: cols){
+        c.data.clear();
+        c.offsets.assign(1, 0);
+        for(long long e = begin; e < end; ++e){
+          c.in->GetEntry(e);
+          const size_t n = size_t(c.leaf->GetLen())*c.typeSize;
+          const char* p = (const char*)c.leaf->GetValuePointer();
+          c.data.insert(c.data.end(), p, p+n);
+          c.offsets.push_back(c.data.size());
+        }
+      }
+
+      perm.resize(end-begin);
+      std::iota(perm.begin(), perm.end(), begin);
+      std::stable_sort(perm.begin(), perm.end(), [&](long long a, long long b){return keys[a] < keys[b];});
+
+      for(long long e: perm){
+        for(sort::Column& c: cols){
+          const size_t i = e-begin;
+          const size_t n = c.offsets[i+1]-c.offsets[i];
+          if(n > c.buf.size()){
+            c.buf.resize(n);
+            c.out->SetAddress(c.buf.data());
+          }
+          memcpy(c.buf.data(), c.data.data()+c.offsets[i], n);
+        }
+        orig = e;
+        tout->Fill();
+      }
+    }
+
+    // The old zone maps no longer match any clusters
+    const std::string zmName = caf::zonemap::TreeName(treeName);
+    const caf::SRZoneMap zm(inFile, treeName);
+
+    fout->cd();
+    tout->Write();
+    merge::CopyKeys(fin.get(), fout.get(), {treeName, zmName});
+    fout->Close();
+
+    if(!zm.Branches().empty()) caf::BuildZoneMap(outFile, zm.Branches(), treeName);
+  }
+}
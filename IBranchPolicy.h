@@ -8,5 +8,27 @@ namespace flat
   {
   public:
     virtual bool Include(const std::string&) const = 0;
+
+    /// \brief How to store the leaf \a name on disk. Empty means the default
+    ///
+    /// Floats may be "f[min,max,nbits]" and doubles "d[min,max,nbits]", for
+    /// ROOT's truncated Float16_t and Double32_t (e.g. "f[0,0,12]" keeps 12
+    /// bits of mantissa). Integers and enums may be one of the leaflist
+    /// codes B, b, S, s, I, i, to store them in a narrower type, and the
+    /// writer aborts on any value that doesn't fit. Readers decode all of
+    /// these transparently.
+    virtual std::string Encoding(const std::string&) const {return "";}
+
+    /// \brief Leave out the ..idx fields of vectors
+    ///
+    /// They are the running sum of the ..length fields within each entry, and
+    /// readers rebuild them from those. Arrays still write theirs.
+    virtual bool DeriveIndices() const {return false;}
+
+    /// \brief Record per-cluster statistics of the leaf \a name
+    ///
+    /// For skipping clusters at read time, see caf::SRZoneMap. Applied by
+    /// flat::ConvertToFlat() once the output is complete.
+    virtual bool ZoneMap(const std::string&) const {return false;}
   };
 }
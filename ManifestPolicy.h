@@ -0,0 +1,56 @@
+#pragma once
+
+#include "SRProxy/IBranchPolicy.h"
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <string>
+
+namespace flat
+{
+  /// \brief Include the branches listed in a manifest, or all the others
+  ///
+  /// The manifest is a list of branch names, as written by
+  /// caf::SRBranchRegistry::ToFile(). Writing a file with each polarity
+  /// gives a "hot" and "cold" split of the same record. The ..length and
+  /// ..idx branches are always included, since every part needs them to
+  /// interpret its own arrays.
+  class ManifestPolicy: public IBranchPolicy
+  {
+  public:
+    ManifestPolicy(const std::set<std::string>& branches, bool listed = true)
+      : fBranches(branches), fListed(listed)
+    {
+    }
+
+    ManifestPolicy(const std::string& manifest, bool listed = true)
+      : fListed(listed)
+    {
+      std::ifstream fin(manifest);
+      if(!fin){
+        std::cout << "ManifestPolicy: unable to open '" << manifest << "'" << std::endl;
+        abort();
+      }
+      std::string b;
+      while(fin >> b) fBranches.insert(b);
+    }
+
+    bool Include(const std::string& name) const override
+    {
+      if(EndsWith(name, "..length") || EndsWith(name, "..idx")) return true;
+      return (fBranches.count(name) > 0) == fListed;
+    }
+
+  protected:
+    static bool EndsWith(const std::string& s, const std::string& suffix)
+    {
+      return s.size() >= suffix.size() &&
+        s.compare(s.size()-suffix.size(), suffix.size(), suffix) == 0;
+    }
+
+    std::set<std::string> fBranches;
+    bool fListed;
+  };
+}
@@ -0,0 +1,352 @@
+#pragma once
+
+#include "SRProxy/BasicTypesProxy.h"
+#include "SRProxy/ColumnarFile.h"
+#include "SRProxy/FlatBasicTypes.h"
+#include "SRProxy/IBranchPolicy.h"
+
+#include "RVersion.h"
+#include "TBranch.h"
+#include "TLeaf.h"
+#include "TTree.h"
+
+#if ROOT_VERSION_CODE < ROOT_VERSION(6,36,0)
+#error "NTupleFile.h needs ROOT 6.36 or later, for the stable RNTuple API"
+#endif
+
+#include <ROOT/REntry.hxx>
+#include <ROOT/RError.hxx>
+#include <ROOT/RField.hxx>
+#include <ROOT/RNTupleDescriptor.hxx>
+#include <ROOT/RNTupleModel.hxx>
+#include <ROOT/RNTupleReader.hxx>
+#include <ROOT/RNTupleUtil.hxx>
+#include <ROOT/RNTupleView.hxx>
+#include <ROOT/RNTupleWriter.hxx>
+
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace caf
+{
+  /// \brief Flat CAFs stored as RNTuples
+  ///
+  /// Every flat branch becomes a top-level field of the same type, scalar
+  /// or std::vector, so the ..length/..idx layout is unchanged. RNTuple
+  /// reserves dots for sub-fields, so they are replaced with colons in the
+  /// field names.
+  namespace ntuple
+  {
+    inline std::string FieldName(std::string branch)
+    {
+      for(char& c: branch) if(c == '.') c = ':';
+      return branch;
+    }
+
+    /// Inverse of FieldName()
+    inline std::string BranchName(std::string field)
+    {
+      for(char& c: field) if(c == ':') c = '.';
+      return field;
+    }
+
+    /// RNTuple type of the values of leaflist type \a code
+    inline std::string TypeName(char code)
+    {
+      switch(code){
+      case 'B': return "std::int8_t";
+      case 'b': return "std::uint8_t";
+      case 'O': return "bool";
+      case 'S': return "std::int16_t";
+      case 's': return "std::uint16_t";
+      case 'I': return "std::int32_t";
+      case 'i': return "std::uint32_t";
+      case 'F': return "float";
+      case 'D': return "double";
+      case 'L': case 'G': return "std::int64_t";
+      case 'l': case 'g': return "std::uint64_t";
+      default: abort();
+      }
+    }
+
+    /// Inverse of TypeName(), or zero if unsupported
+    inline char TypeCode(const std::string& t)
+    {
+      if(t == "std::int8_t") return 'B';
+      if(t == "std::uint8_t") return 'b';
+      if(t == "bool") return 'O';
+      if(t == "std::int16_t") return 'S';
+      if(t == "std::uint16_t") return 's';
+      if(t == "std::int32_t") return 'I';
+      if(t == "std::uint32_t") return 'i';
+      if(t == "float") return 'F';
+      if(t == "double") return 'D';
+      if(t == "std::int64_t") return 'L';
+      if(t == "std::uint64_t") return 'l';
+      return 0;
+    }
+  } // namespace ntuple
+
+  /// \tparam V The field type, a number or a vector of them
+  template<class V> class SRNTupleColumnT: public SRNTupleColumn
+  {
+  public:
+    SRNTupleColumnT(char code, ROOT::RNTupleReader& reader, const std::string& field)
+      : SRNTupleColumn(code), fView(reader.GetView<V>(field))
+    {
+    }
+
+  protected:
+    void Load(long entry) const override
+    {
+      // Only the pages of fields with views are ever read
+      const V& v = fView(entry);
+      fEntry = entry;
+
+      if constexpr(flat::is_vec<V>::value){
+        if constexpr(std::is_same_v<V, std::vector<bool>>){
+          // Bit-packed, so copy out
+          fBools.assign(v.begin(), v.end());
+          fValues = fBools.data();
+        }
+        else{
+          fValues = (const char*)v.data();
+        }
+        fN = v.size();
+      }
+      else{
+        fValues = (const char*)&v;
+        fN = 1;
+      }
+    }
+
+    mutable ROOT::RNTupleView<V> fView;
+    mutable std::vector<char> fBools;
+  };
+
+  /// \brief Presents an RNTuple flat CAF as a TTree that proxies can be
+  /// built on
+  ///
+  /// As for SRMappedTree, the tree has no branches of its own. Set its read
+  /// entry with GetEntry() or LoadTree() as usual, and the proxies (which
+  /// detect it as kNTuple) read through RNTuple views of the fields they
+  /// use. Fields nobody reads are never decompressed.
+  class SRNTupleTree: public SRNTupleTreeBase
+  {
+  public:
+    SRNTupleTree(const std::string& fname, const std::string& ntupleName = "recTree")
+      : SRNTupleTreeBase("srproxy_ntuple", fname.c_str())
+    {
+      SetDirectory(0); // we own ourselves
+
+      try{
+        fReader = ROOT::RNTupleReader::Open(ntupleName, fname);
+      }
+      catch(const ROOT::RException& e){
+        std::cout << "SRNTupleTree: unable to open RNTuple '" << ntupleName << "' in '" << fname << "': " << e.what() << std::endl;
+        abort();
+      }
+
+      SetEntries(fReader->GetNEntries());
+    }
+
+    /// Returns null if the column is not in the file
+    const SRNTupleColumn* GetColumn(const std::string& name) override
+    {
+      auto it = fColumns.find(name);
+      if(it != fColumns.end()) return it->second.get();
+
+      // Remember missing columns too, they're looked up repeatedly
+      std::unique_ptr<SRNTupleColumn>& col = fColumns[name];
+
+      const std::string field = ntuple::FieldName(name);
+      const ROOT::RNTupleDescriptor& desc = fReader->GetDescriptor();
+      const ROOT::DescriptorId_t id = desc.FindFieldId(field);
+      if(id == ROOT::kInvalidDescriptorId) return 0;
+
+      std::string type = desc.GetFieldDescriptor(id).GetTypeName();
+      const std::string vec = "std::vector<";
+      const bool isArray = type.compare(0, vec.size(), vec) == 0 && type.back() == '>';
+      if(isArray) type = type.substr(vec.size(), type.size()-vec.size()-1);
+
+      const char code = ntuple::TypeCode(type);
+      switch(code){
+      case 'B': col = Make<std::int8_t>(code, isArray, field); break;
+      case 'b': col = Make<std::uint8_t>(code, isArray, field); break;
+      case 'O': col = Make<bool>(code, isArray, field); break;
+      case 'S': col = Make<std::int16_t>(code, isArray, field); break;
+      case 's': col = Make<std::uint16_t>(code, isArray, field); break;
+      case 'I': col = Make<std::int32_t>(code, isArray, field); break;
+      case 'i': col = Make<std::uint32_t>(code, isArray, field); break;
+      case 'F': col = Make<float>(code, isArray, field); break;
+      case 'D': col = Make<double>(code, isArray, field); break;
+      case 'L': col = Make<std::int64_t>(code, isArray, field); break;
+      case 'l': col = Make<std::uint64_t>(code, isArray, field); break;
+      default:
+        std::cout << "SRNTupleTree: field '" << field << "' has unsupported type '" << type << "'" << std::endl;
+        abort();
+      }
+
+      return col.get();
+    }
+
+    std::vector<std::string> ColumnNames() const override
+    {
+      std::vector<std::string> ret;
+      for(const ROOT::RFieldDescriptor& f: fReader->GetDescriptor().GetTopLevelFields()){
+        ret.push_back(ntuple::BranchName(f.GetFieldName()));
+      }
+      return ret;
+    }
+
+    Int_t GetEntry(Long64_t entry, Int_t = 0) override
+    {
+      fReadEntry = entry;
+      return 1;
+    }
+
+    Long64_t LoadTree(Long64_t entry) override
+    {
+      fReadEntry = entry;
+      return entry;
+    }
+
+  protected:
+    template<class E> std::unique_ptr<SRNTupleColumn> Make(char code, bool isArray, const std::string& field)
+    {
+      if(isArray) return std::make_unique<SRNTupleColumnT<std::vector<E>>>(code, *fReader, field);
+      return std::make_unique<SRNTupleColumnT<E>>(code, *fReader, field);
+    }
+
+    std::unique_ptr<ROOT::RNTupleReader> fReader;
+    std::unordered_map<std::string, std::unique_ptr<SRNTupleColumn>> fColumns;
+  };
+}
+
+namespace flat
+{
+  /// \brief Writes records in the flat layout, as an RNTuple
+  ///
+  /// The RNTuple counterpart of filling a TTree with Flat<T>. The generated
+  /// flat writer fills its buffers as usual, in a scratch tree that is
+  /// never filled itself, and each branch is copied to the field of the
+  /// same name (see caf::ntuple). Policies apply as for TTrees, including
+  /// narrowed integers. Truncated floats are stored at full precision.
+  /// Read the output back with caf::SRNTupleTree.
+  ///
+  /// \tparam T The record type, e.g. caf::StandardRecord. Its flat writer,
+  ///           from gen_srproxy --flat, must be loaded
+  template<class T> class NTupleWriter
+  {
+  public:
+    /// \param branchName Prefix of the flat fields, as for Flat<T>
+    /// \param policy     Which leaves to write. Null means all
+    NTupleWriter(const std::string& fname,
+                 const std::string& ntupleName = "recTree",
+                 const std::string& branchName = "rec",
+                 const IBranchPolicy* policy = 0)
+      : fTree(new TTree(ntupleName.c_str(), ntupleName.c_str()))
+    {
+      fTree->SetDirectory(0); // only holds the buffers, never written
+      fFlat = std::make_unique<Flat<T>>(fTree.get(), branchName, "", policy);
+
+      std::unique_ptr<ROOT::RNTupleModel> model = ROOT::RNTupleModel::Create();
+
+      struct Col{TLeaf* leaf; char code; bool isArray; std::string field;};
+      std::vector<Col> cols;
+
+      const TObjArray* brs = fTree->GetListOfBranches();
+      for(int i = 0; i < brs->GetEntriesFast(); ++i){
+        TBranch* br = (TBranch*)brs->UncheckedAt(i);
+        TLeaf* leaf = br->GetLeaf(br->GetName());
+        const char code = leaf ? caf::columnar::TypeCode(leaf) : 0;
+        if(!code){
+          std::cout << "NTupleWriter: skipping unsupported branch '" << br->GetName() << "'" << std::endl;
+          continue;
+        }
+
+        const bool isArray = leaf->GetLeafCount() || leaf->GetLenStatic() > 1;
+        const std::string field = caf::ntuple::FieldName(br->GetName());
+        const std::string type = caf::ntuple::TypeName(code);
+        model->AddField(ROOT::RFieldBase::Create(field, isArray ? "std::vector<"+type+">" : type).Unwrap());
+        cols.push_back({leaf, code, isArray, field});
+      }
+
+      try{
+        fWriter = ROOT::RNTupleWriter::Recreate(std::move(model), ntupleName, fname);
+      }
+      catch(const ROOT::RException& e){
+        std::cout << "NTupleWriter: unable to open '" << fname << "': " << e.what() << std::endl;
+        abort();
+      }
+      fEntry = fWriter->CreateEntry();
+
+      for(const Col& c: cols){
+        switch(c.code){
+        case 'B': AddCopy<std::int8_t>(c.leaf, c.isArray, c.field); break;
+        case 'b': AddCopy<std::uint8_t>(c.leaf, c.isArray, c.field); break;
+        case 'O': AddCopy<bool>(c.leaf, c.isArray, c.field); break;
+        case 'S': AddCopy<std::int16_t>(c.leaf, c.isArray, c.field); break;
+        case 's': AddCopy<std::uint16_t>(c.leaf, c.isArray, c.field); break;
+        case 'I': AddCopy<std::int32_t>(c.leaf, c.isArray, c.field); break;
+        case 'i': AddCopy<std::uint32_t>(c.leaf, c.isArray, c.field); break;
+        case 'F': AddCopy<float>(c.leaf, c.isArray, c.field); break;
+        case 'D': AddCopy<double>(c.leaf, c.isArray, c.field); break;
+        case 'L': case 'G': AddCopy<std::int64_t>(c.leaf, c.isArray, c.field); break;
+        case 'l': case 'g': AddCopy<std::uint64_t>(c.leaf, c.isArray, c.field); break;
+        default: abort();
+        }
+      }
+    }
+
+    NTupleWriter(const NTupleWriter&) = delete;
+    NTupleWriter& operator=(const NTupleWriter&) = delete;
+
+    void Fill(const T& rec)
+    {
+      fFlat->Clear();
+      fFlat->Fill(rec);
+      for(const std::function<void()>& copy: fCopies) copy();
+      fWriter->Fill(*fEntry);
+    }
+
+  protected:
+    /// Values in the buffer of \a leaf. Not TLeaf::GetLen(), which would try
+    /// to read the count branch
+    static int Len(const TLeaf* leaf)
+    {
+      const TLeaf* count = leaf->GetLeafCount();
+      if(!count) return leaf->GetLenStatic();
+      return int(count->GetValue())*leaf->GetLenStatic();
+    }
+
+    template<class E> void AddCopy(TLeaf* leaf, bool isArray, const std::string& field)
+    {
+      // The buffers move as Flat<T> grows them, so look them up each time
+      if(isArray){
+        std::shared_ptr<std::vector<E>> v = fEntry->GetPtr<std::vector<E>>(field);
+        fCopies.push_back([leaf, v](){
+            const E* p = (const E*)leaf->GetValuePointer();
+            v->assign(p, p+Len(leaf));
+          });
+      }
+      else{
+        std::shared_ptr<E> v = fEntry->GetPtr<E>(field);
+        fCopies.push_back([leaf, v](){*v = *(const E*)leaf->GetValuePointer();});
+      }
+    }
+
+    // fFlat must go before the tree holding its branches
+    std::unique_ptr<TTree> fTree;
+    std::unique_ptr<Flat<T>> fFlat;
+
+    std::unique_ptr<ROOT::RNTupleWriter> fWriter; ///< Commits the file when deleted
+    std::unique_ptr<ROOT::REntry> fEntry;
+    std::vector<std::function<void()>> fCopies;
+  };
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+namespace caf
+{
+  /// \brief Temporary ROOT files, removed when this goes out of scope
+  ///
+  /// Each name is made unique by mkstemps(), so that concurrent jobs writing
+  /// next to the same output never pick the same one. abort() doesn't run
+  /// destructors, so errors should go through Fail(), which removes the
+  /// files first.
+  class SRTempFiles
+  {
+  public:
+    /// \param who Prefix for error messages, e.g. the calling function
+    SRTempFiles(const std::string& who) : fWho(who) {}
+    ~SRTempFiles(){Remove();}
+
+    SRTempFiles(const SRTempFiles&) = delete;
+    SRTempFiles& operator=(const SRTempFiles&) = delete;
+
+    /// A new empty file, named \a prefix, then a unique suffix, then ".root"
+    std::string Add(const std::string& prefix)
+    {
+      std::string name = prefix+"XXXXXX.root";
+      const int fd = mkstemps(name.data(), 5);
+      if(fd < 0) Fail("unable to create a temporary file '"+prefix+"XXXXXX.root'");
+      close(fd);
+
+      std::lock_guard<std::mutex> lock(fMutex);
+      fNames.push_back(name);
+      return name;
+    }
+
+    /// Remove \a name now, rather than with the others
+    void Remove(const std::string& name)
+    {
+      std::lock_guard<std::mutex> lock(fMutex);
+      for(auto it = fNames.begin(); it != fNames.end(); ++it){
+        if(*it == name){
+          unlink(name.c_str());
+          fNames.erase(it);
+          return;
+        }
+      }
+    }
+
+    void Remove()
+    {
+      std::lock_guard<std::mutex> lock(fMutex);
+      for(const std::string& name: fNames) unlink(name.c_str());
+      fNames.clear();
+    }
+
+    /// Print \a msg, remove the files, and abort. Safe to call from any thread
+    void Fail(const std::string& msg)
+    {
+      std::cout << fWho << ": " << msg << std::endl;
+      Remove();
+      abort();
+    }
+
+  protected:
+    std::string fWho;
+    std::mutex fMutex;
+    std::vector<std::string> fNames;
+  };
+}
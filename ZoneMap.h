@@ -0,0 +1,254 @@
+#pragma once
+
+#include "SRProxy/ColumnarFile.h"
+
+#include "TBranch.h"
+#include "TFile.h"
+#include "TLeaf.h"
+#include "TObject.h"
+#include "TTree.h"
+
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace caf
+{
+  /// Statistics of one branch over one cluster
+  struct SRZone
+  {
+    long long begin, end; ///< Entries of the cluster
+    double min, max;      ///< Of the values that aren't NaN
+    long long nvals;      ///< All values, including NaNs
+    long long nnan;
+    long long nempty;     ///< Entries with no values, e.g. empty vectors
+  };
+
+  /// \brief Require some value of \a branch to lie in [lo, hi]
+  ///
+  /// Either bound may be infinite. For a scalar branch this is simply a cut
+  /// on its value.
+  struct SRRangeCut
+  {
+    std::string branch;
+    double lo, hi;
+  };
+
+  namespace zonemap
+  {
+    /// The zone map is stored next to the tree it describes
+    inline std::string TreeName(const std::string& treeName)
+    {
+      return treeName+"_zonemap";
+    }
+
+    const int kMaxName = 1024;
+  }
+
+  /// \brief Record per-cluster statistics of \a branches in the flat CAF
+  /// \a fname
+  ///
+  /// The statistics are written into the file itself, as the small tree
+  /// zonemap::TreeName(treeName), replacing any previous one. Only the
+  /// chosen branches are read. Branches that are missing or not numeric are
+  /// skipped with a warning.
+  inline void BuildZoneMap(const std::string& fname,
+                           const std::vector<std::string>& branches,
+                           const std::string& treeName = "recTree")
+  {
+    std::unique_ptr<TFile> f(TFile::Open(fname.c_str(), "UPDATE"));
+    TTree* tr = 0;
+    if(f && !f->IsZombie()) f->GetObject(treeName.c_str(), tr);
+    if(!tr){
+      std::cout << "BuildZoneMap: no tree '" << treeName << "' in '" << fname << "'" << std::endl;
+      abort();
+    }
+
+    // The clusters are shared by all branches
+    const long long N = tr->GetEntries();
+    std::vector<std::pair<long long, long long>> clusters;
+    TTree::TClusterIterator it = tr->GetClusterIterator(0);
+    for(long long start = it.Next(); start < N; start = it.Next()){
+      clusters.emplace_back(start, it.GetNextEntry());
+    }
+
+    const std::string zmName = zonemap::TreeName(treeName);
+    TTree* zm = new TTree(zmName.c_str(), "Per-cluster statistics, see caf::SRZoneMap");
+    char name[zonemap::kMaxName];
+    SRZone z;
+    zm->Branch("branch", name, "branch/C");
+    zm->Branch("begin", &z.begin, "begin/L");
+    zm->Branch("end", &z.end, "end/L");
+    zm->Branch("min", &z.min, "min/D");
+    zm->Branch("max", &z.max, "max/D");
+    zm->Branch("nvals", &z.nvals, "nvals/L");
+    zm->Branch("nnan", &z.nnan, "nnan/L");
+    zm->Branch("nempty", &z.nempty, "nempty/L");
+
+    for(const std::string& b: branches){
+      TBranch* br = tr->GetBranch(b.c_str());
+      TLeaf* leaf = br ? br->GetLeaf(b.c_str()) : 0;
+      if(!leaf || !columnar::TypeCode(leaf) || b.size() >= sizeof(name)){
+        std::cout << "BuildZoneMap: skipping '" << b << "', which is missing or not numeric" << std::endl;
+        continue;
+      }
+      strncpy(name, b.c_str(), sizeof(name));
+
+      // Branch by branch, so that each streams through its baskets in order
+      for(const std::pair<long long, long long>& c: clusters){
+        z = {c.first, c.second,
+             std::numeric_limits<double>::infinity(),
+             -std::numeric_limits<double>::infinity(),
+             0, 0, 0};
+
+        for(long long e = c.first; e < c.second; ++e){
+          br->GetEntry(e);
+          const int n = leaf->GetLen();
+          if(n == 0) ++z.nempty;
+          for(int i = 0; i < n; ++i){
+            const double v = leaf->GetValue(i);
+            ++z.nvals;
+            if(std::isnan(v)){
+              ++z.nnan;
+              continue;
+            }
+            z.min = std::min(z.min, v);
+            z.max = std::max(z.max, v);
+          }
+        }
+
+        zm->Fill();
+      }
+    }
+
+    f->cd();
+    zm->Write("", TObject::kOverwrite);
+    f->Close();
+  }
+
+  /// \brief Reader for the statistics written by BuildZoneMap()
+  ///
+  /// Selects the clusters that may pass a set of range cuts, so that the
+  /// others can be skipped without reading, let alone decompressing, any of
+  /// their baskets.
+  class SRZoneMap
+  {
+  public:
+    SRZoneMap(const std::string& fname, const std::string& treeName = "recTree")
+    {
+      std::unique_ptr<TFile> f(TFile::Open(fname.c_str()));
+      TTree* tr = 0;
+      if(f && !f->IsZombie()) f->GetObject(treeName.c_str(), tr);
+      if(!tr){
+        std::cout << "SRZoneMap: no tree '" << treeName << "' in '" << fname << "'" << std::endl;
+        abort();
+      }
+
+      const long long N = tr->GetEntries();
+      TTree::TClusterIterator it = tr->GetClusterIterator(0);
+      for(long long start = it.Next(); start < N; start = it.Next()){
+        fClusters.emplace_back(start, it.GetNextEntry());
+      }
+
+      // No zone map just means nothing can be skipped
+      TTree* zm = 0;
+      f->GetObject(zonemap::TreeName(treeName).c_str(), zm);
+      if(!zm) return;
+
+      char name[zonemap::kMaxName];
+      SRZone z;
+      zm->SetBranchAddress("branch", name);
+      zm->SetBranchAddress("begin", &z.begin);
+      zm->SetBranchAddress("end", &z.end);
+      zm->SetBranchAddress("min", &z.min);
+      zm->SetBranchAddress("max", &z.max);
+      zm->SetBranchAddress("nvals", &z.nvals);
+      zm->SetBranchAddress("nnan", &z.nnan);
+      zm->SetBranchAddress("nempty", &z.nempty);
+
+      for(long long i = 0; i < zm->GetEntries(); ++i){
+        zm->GetEntry(i);
+        fZones[name].push_back(z);
+      }
+    }
+
+    bool Has(const std::string& branch) const {return fZones.count(branch);}
+
+    /// The branches with statistics
+    std::vector<std::string> Branches() const
+    {
+      std::vector<std::string> ret;
+      for(const auto& it: fZones) ret.push_back(it.first);
+      return ret;
+    }
+
+    /// Statistics of each cluster, in order. Empty if not recorded
+    const std::vector<SRZone>& Zones(const std::string& branch) const
+    {
+      static const std::vector<SRZone> kNone;
+      auto it = fZones.find(branch);
+      return (it == fZones.end()) ? kNone : it->second;
+    }
+
+    /// All the clusters of the tree, as [begin, end) entry ranges
+    const std::vector<std::pair<long long, long long>>& Clusters() const {return fClusters;}
+
+    /// \brief Whether the statistics of \a branch describe the tree's
+    /// clusters as they are now
+    ///
+    /// Not if the tree was rewritten since, with different clustering.
+    bool Current(const std::string& branch) const
+    {
+      const std::vector<SRZone>& zones = Zones(branch);
+      if(zones.size() != fClusters.size()) return false;
+      for(unsigned int c = 0; c < zones.size(); ++c){
+        if(zones[c].begin != fClusters[c].first || zones[c].end != fClusters[c].second) return false;
+      }
+      return true;
+    }
+
+    /// \brief The entry ranges [begin, end) that may pass all of \a cuts
+    ///
+    /// Adjacent clusters are merged. Cuts on branches without (current)
+    /// statistics can't rule anything out, and are ignored.
+    std::vector<std::pair<long long, long long>> Select(const std::vector<SRRangeCut>& cuts) const
+    {
+      std::vector<std::pair<long long, long long>> ret;
+
+      std::vector<std::pair<const SRRangeCut*, const std::vector<SRZone>*>> usable;
+      for(const SRRangeCut& cut: cuts){
+        if(Current(cut.branch)) usable.emplace_back(&cut, &Zones(cut.branch));
+      }
+
+      for(unsigned int c = 0; c < fClusters.size(); ++c){
+        bool pass = true;
+        for(const auto& [cut, zones]: usable){
+          const SRZone& z = (*zones)[c];
+          // Entirely NaN or empty clusters have nothing that could pass
+          if(z.nvals == z.nnan || z.max < cut->lo || z.min > cut->hi){
+            pass = false;
+            break;
+          }
+        }
+        if(!pass) continue;
+
+        if(!ret.empty() && ret.back().second == fClusters[c].first)
+          ret.back().second = fClusters[c].second;
+        else
+          ret.push_back(fClusters[c]);
+      }
+
+      return ret;
+    }
+
+  protected:
+    std::vector<std::pair<long long, long long>> fClusters;
+    std::map<std::string, std::vector<SRZone>> fZones;
+  };
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+// Synthetic StandardRecord for the SRProxy benchmark suite. It is small, but
+// exercises every layout gen_srproxy has to handle: nested vectors, inline
+// and out-of-line arrays, strings, enums and inheritance.
+
+#include <string>
+#include <vector>
+
+namespace caf
+{
+  enum EBenchKind
+  {
+    kKindA,
+    kKindB,
+    kKindC
+  };
+
+  class SRBenchHit
+  {
+  public:
+    float x;
+    float y;
+    float e;
+    bool good;
+  };
+
+  class SRBenchVector
+  {
+  public:
+    float x;
+    float y;
+    float z;
+  };
+
+  class SRBenchVertex: public SRBenchVector
+  {
+  public:
+    int nprong;
+  };
+
+  class SRBenchTrack
+  {
+  public:
+    float len;
+    int pdg;
+    float dir[3];   // inline array
+    float cov[21];  // out-of-line array
+    std::vector<SRBenchHit> hits;
+  };
+
+  class SRBenchSlice
+  {
+  public:
+    float energy;
+    EBenchKind kind;
+    unsigned int nhit;
+    std::string label;
+    SRBenchVertex vtx;
+    std::vector<SRBenchTrack> trk;
+  };
+
+  class SRBenchHeader
+  {
+  public:
+    unsigned int run;
+    unsigned int subrun;
+    unsigned int evt;
+    bool ismc;
+    double pot;
+  };
+
+  class StandardRecord
+  {
+  public:
+    SRBenchHeader hdr;
+    std::vector<SRBenchSlice> slc;
+    std::vector<std::vector<float>> wgts;
+    std::string tag;
+  };
+}
@@ -0,0 +1,20 @@
+#ifdef __CINT__
+
+#pragma link off all globals;
+#pragma link off all classes;
+#pragma link off all functions;
+
+#pragma link C++ class caf::SRBenchHit+;
+#pragma link C++ class caf::SRBenchVector+;
+#pragma link C++ class caf::SRBenchVertex+;
+#pragma link C++ class caf::SRBenchTrack+;
+#pragma link C++ class caf::SRBenchSlice+;
+#pragma link C++ class caf::SRBenchHeader+;
+#pragma link C++ class caf::StandardRecord+;
+
+#pragma link C++ class std::vector<caf::SRBenchHit>+;
+#pragma link C++ class std::vector<caf::SRBenchTrack>+;
+#pragma link C++ class std::vector<caf::SRBenchSlice>+;
+#pragma link C++ class std::vector<std::vector<float>>+;
+
+#endif
@@ -0,0 +1,49 @@
+#!/bin/bash
+
+# Build and run the SRProxy benchmark suite against the sources in this
+# checkout. Requires ROOT, plus castxml and pygccxml for gen_srproxy.
+
+if [ $# -gt 3 ]
+then
+    echo Usage: run_bench.sh [WORKDIR] [ENTRIES] [LABEL]
+    exit 2
+fi
+
+srcdir=$(cd $(dirname $0) && pwd)
+topdir=$(dirname $srcdir)
+
+[ -z "$1" ] && workdir="$PWD/srproxy_bench" || workdir="$1"
+[ -z "$2" ] && entries=10000 || entries="$2"
+[ -z "$3" ] && label=`git -C $topdir describe --always --dirty 2>/dev/null` || label="$3"
+
+inc=$workdir/include
+
+mkdir -p $inc/SRProxy $inc/BenchProxy $inc/BenchFlat || exit 1
+
+# Generated code and the benchmark include the SRProxy sources as SRProxy/
+cp $topdir/*.h $topdir/*.cxx $inc/SRProxy || exit 1
+echo '#include "BenchRecord.h"' > $inc/prolog.h
+
+echo "Generating proxy and flat classes.."
+(cd $inc/BenchProxy && $topdir/gen_srproxy -i BenchRecord.h -o SRProxy -t caf::StandardRecord \
+    -p $srcdir -op BenchProxy --prolog $inc/prolog.h) || exit 1
+(cd $inc/BenchFlat && $topdir/gen_srproxy --flat -i BenchRecord.h -o FlatRecord -t caf::StandardRecord \
+    -p $srcdir -op BenchFlat --prolog $inc/prolog.h) || exit 1
+
+echo "Generating dictionary for the nested record.."
+(cd $workdir && rootcling -f BenchDict.cxx -I$srcdir BenchRecord.h LinkDef.h) || exit 1
+
+echo "Compiling.."
+${CXX:-g++} -O2 -std=c++17 `root-config --cflags` -I$inc -I$srcdir -I$workdir \
+    $inc/SRProxy/BasicTypesProxy.cxx \
+    $inc/BenchProxy/SRProxy.cxx \
+    $inc/BenchFlat/FlatRecord.cxx \
+    $workdir/BenchDict.cxx \
+    $srcdir/srproxy_bench.cxx \
+    `root-config --libs` -lTreePlayer \
+    -o $workdir/srproxy_bench || exit 1
+
+echo "Running.."
+$workdir/srproxy_bench -n $entries -d $workdir -l "$label" -o $workdir/bench_results.json || exit 1
+
+echo Results written to $workdir/bench_results.json
@@ -0,0 +1,361 @@
+// SRProxy benchmark suite. See run_bench.sh for how this is built and run.
+//
+// Writes flat and nested files of a synthetic StandardRecord, then times the
+// reader and writer on them, and reports the results as JSON so that they
+// can be compared between releases. The values read back are checked
+// against the records written first.
+
+#include "BenchProxy/SRProxy.h"
+#include "BenchFlat/FlatRecord.h"
+
+#include "BenchRecord.h"
+
+#include "TFile.h"
+#include "TTree.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace
+{
+  struct Result
+  {
+    std::string name;
+    std::string mode;
+    long ops;
+    double seconds;
+  };
+
+  std::vector<Result> gResults;
+
+  /// Time \a func, which performs \a ops operations, and record the result
+  void Time(const std::string& name, const std::string& mode, long ops,
+            const std::function<void()>& func)
+  {
+    const auto t0 = std::chrono::steady_clock::now();
+    func();
+    const auto t1 = std::chrono::steady_clock::now();
+
+    const double secs = std::chrono::duration<double>(t1-t0).count();
+    gResults.push_back({name, mode, ops, secs});
+
+    std::cerr << name << " (" << mode << "): " << 1e9*secs/ops << " ns/op" << std::endl;
+  }
+
+  /// Defeat the optimizer without printing anything
+  volatile double gSink = 0;
+
+  //----------------------------------------------------------------------
+  void MakeRecord(caf::StandardRecord& sr, unsigned int evt, std::mt19937& rng)
+  {
+    std::uniform_real_distribution<float> uni(0, 1);
+    std::poisson_distribution<int> nslc(3), ntrk(4), nhit(20);
+
+    sr.hdr.run = 1000;
+    sr.hdr.subrun = evt/100;
+    sr.hdr.evt = evt;
+    sr.hdr.ismc = true;
+    sr.hdr.pot = 1e13*uni(rng);
+
+    sr.tag = "bench-" + std::to_string(evt%7);
+
+    sr.slc.resize(nslc(rng));
+    for(caf::SRBenchSlice& slc: sr.slc){
+      slc.energy = 10*uni(rng);
+      slc.kind = caf::EBenchKind(evt%3);
+      slc.label = (evt%2) ? "numu" : "nue";
+      slc.vtx.x = uni(rng); slc.vtx.y = uni(rng); slc.vtx.z = uni(rng);
+      slc.vtx.nprong = ntrk(rng);
+
+      slc.nhit = 0;
+      slc.trk.resize(ntrk(rng));
+      for(caf::SRBenchTrack& trk: slc.trk){
+        trk.len = 100*uni(rng);
+        trk.pdg = 13;
+        for(float& d: trk.dir) d = uni(rng);
+        for(float& c: trk.cov) c = uni(rng);
+
+        trk.hits.resize(nhit(rng));
+        slc.nhit += trk.hits.size();
+        for(caf::SRBenchHit& hit: trk.hits){
+          hit.x = uni(rng); hit.y = uni(rng); hit.e = uni(rng);
+          hit.good = uni(rng) > .1;
+        }
+      }
+    }
+
+    sr.wgts.resize(4);
+    for(std::vector<float>& w: sr.wgts) w.assign(10, 1+.1*uni(rng));
+  }
+
+  //----------------------------------------------------------------------
+  void WriteFlat(const std::string& fname, long N)
+  {
+    TFile fout(fname.c_str(), "RECREATE");
+    TTree* tr = new TTree("recTree", "recTree");
+
+    flat::Flat<caf::StandardRecord> rec(tr, "rec", "", 0);
+
+    std::mt19937 rng(1234);
+    caf::StandardRecord sr;
+
+    Time("writer_fill", "flat", N, [&](){
+      for(long i = 0; i < N; ++i){
+        MakeRecord(sr, i, rng);
+        rec.Clear();
+        rec.Fill(sr);
+        tr->Fill();
+      }
+    });
+
+    fout.Write();
+  }
+
+  //----------------------------------------------------------------------
+  void WriteNested(const std::string& fname, long N)
+  {
+    TFile fout(fname.c_str(), "RECREATE");
+    TTree* tr = new TTree("recTree", "recTree");
+
+    std::mt19937 rng(1234);
+    caf::StandardRecord sr;
+    caf::StandardRecord* psr = &sr;
+    tr->Branch("rec", &psr);
+
+    Time("writer_fill", "nested", N, [&](){
+      for(long i = 0; i < N; ++i){
+        MakeRecord(sr, i, rng);
+        tr->Fill();
+      }
+    });
+
+    fout.Write();
+  }
+
+  //----------------------------------------------------------------------
+  void BenchRead(const std::string& fname, const std::string& mode)
+  {
+    TFile fin(fname.c_str());
+    TTree* tr = 0;
+    fin.GetObject("recTree", tr);
+    if(!tr){
+      std::cerr << "No recTree in " << fname << std::endl;
+      abort();
+    }
+    const long N = tr->GetEntries();
+
+    const int kNConstruct = 100;
+    Time("proxy_construct", mode, kNConstruct, [&](){
+      for(int i = 0; i < kNConstruct; ++i){
+        caf::StandardRecordProxy sr(tr, "rec");
+        gSink = gSink + sr.hdr.run.Name().size();
+      }
+    });
+
+    // Each of the following gets a fresh proxy tree, so that no values are
+    // carried over between them
+    {
+      caf::StandardRecordProxy sr(tr, "rec");
+      Time("scalar_read", mode, N, [&](){
+        for(long i = 0; i < N; ++i){
+          tr->LoadTree(i);
+          gSink = gSink + sr.hdr.run + sr.hdr.evt + sr.hdr.pot;
+        }
+      });
+    }
+
+    {
+      caf::StandardRecordProxy sr(tr, "rec");
+      long nhits = 0;
+      Time("vector_access", mode, N, [&](){
+        for(long i = 0; i < N; ++i){
+          tr->LoadTree(i);
+          double tot = 0;
+          for(const auto& slc: sr.slc){
+            for(const auto& trk: slc.trk){
+              tot += trk.dir[0] + trk.cov[20];
+              for(const auto& hit: trk.hits){
+                if(hit.good) tot += hit.e;
+                ++nhits;
+              }
+            }
+          }
+          gSink = gSink + tot;
+        }
+      });
+    }
+
+    {
+      caf::StandardRecordProxy sr(tr, "rec");
+      Time("vector_views", mode, N, [&](){
+        for(long i = 0; i < N; ++i){
+          tr->LoadTree(i);
+          double tot = 0;
+          for(const auto& slc: sr.slc.views()){
+            for(const auto& trk: slc.trk.views()){
+              tot += trk.dir[0] + trk.cov[20];
+              for(const auto& hit: trk.hits.views()){
+                if(hit.good) tot += hit.e;
+              }
+            }
+          }
+          gSink = gSink + tot;
+        }
+      });
+    }
+
+    {
+      caf::StandardRecordProxy sr(tr, "rec");
+      Time("syst_transaction", mode, N, [&](){
+        for(long i = 0; i < N; ++i){
+          tr->LoadTree(i);
+          for(int univ = 0; univ < 10; ++univ){
+            caf::SRProxySystController::BeginTransaction();
+            for(auto& slc: sr.slc){
+              slc.energy *= 1+.01*univ;
+              gSink = gSink + slc.energy;
+            }
+            caf::SRProxySystController::Rollback();
+          }
+        }
+      });
+    }
+  }
+
+  //----------------------------------------------------------------------
+  /// Check that the proxies read back exactly the records that were written.
+  /// Returns the number of entries that differ
+  long Verify(const std::string& fname, const std::string& mode)
+  {
+    TFile fin(fname.c_str());
+    TTree* tr = 0;
+    fin.GetObject("recTree", tr);
+    if(!tr){
+      std::cerr << "No recTree in " << fname << std::endl;
+      abort();
+    }
+    const long N = tr->GetEntries();
+
+    caf::StandardRecordProxy srp(tr, "rec");
+
+    // The same sequence as when writing
+    std::mt19937 rng(1234);
+    caf::StandardRecord sr;
+
+    // CheckEquals() reports differences on std::cout
+    std::ostringstream diffs;
+    std::streambuf* cout = std::cout.rdbuf(diffs.rdbuf());
+
+    long nbad = 0;
+    std::string first;
+    for(long i = 0; i < N; ++i){
+      MakeRecord(sr, i, rng);
+      tr->LoadTree(i);
+      srp.CheckEquals(sr);
+      if(!diffs.str().empty()){
+        if(nbad++ == 0) first = diffs.str();
+        diffs.str("");
+      }
+    }
+
+    std::cout.rdbuf(cout);
+
+    if(nbad > 0){
+      std::cerr << "verify (" << mode << "): " << nbad << "/" << N
+                << " entries differ. The first:\n" << first;
+    }
+    return nbad;
+  }
+
+  //----------------------------------------------------------------------
+  /// \a s as a JSON string literal
+  std::string Quote(const std::string& s)
+  {
+    std::string ret = "\"";
+    for(const char c: s){
+      switch(c){
+      case '"':  ret += "\\\""; break;
+      case '\\': ret += "\\\\"; break;
+      case '\n': ret += "\\n"; break;
+      case '\t': ret += "\\t"; break;
+      default:
+        if((unsigned char)c < 0x20){
+          char buf[8];
+          snprintf(buf, sizeof(buf), "\\u%04x", c);
+          ret += buf;
+        }
+        else{
+          ret += c;
+        }
+      }
+    }
+    return ret + "\"";
+  }
+
+  //----------------------------------------------------------------------
+  void WriteJSON(std::ostream& os, long N, const std::string& label)
+  {
+    os << "{\n"
+       << "  \"label\": " << Quote(label) << ",\n"
+       << "  \"entries\": " << N << ",\n"
+       << "  \"benchmarks\": [\n";
+    for(unsigned int i = 0; i < gResults.size(); ++i){
+      const Result& r = gResults[i];
+      os << "    {\"name\": " << Quote(r.name) << ", \"mode\": " << Quote(r.mode)
+         << ", \"ops\": " << r.ops << ", \"seconds\": " << r.seconds
+         << ", \"ns_per_op\": " << 1e9*r.seconds/r.ops << "}"
+         << (i+1 < gResults.size() ? "," : "") << "\n";
+    }
+    os << "  ]\n"
+       << "}\n";
+  }
+}
+
+//----------------------------------------------------------------------
+int main(int argc, char** argv)
+{
+  long N = 10000;
+  std::string out, label, dir = ".";
+
+  for(int i = 1; i < argc; ++i){
+    const std::string arg = argv[i];
+    if(arg == "-n" && i+1 < argc) N = atol(argv[++i]);
+    else if(arg == "-o" && i+1 < argc) out = argv[++i];
+    else if(arg == "-l" && i+1 < argc) label = argv[++i];
+    else if(arg == "-d" && i+1 < argc) dir = argv[++i];
+    else{
+      std::cerr << "Usage: " << argv[0] << " [-n ENTRIES] [-o OUT.json] [-l LABEL] [-d WORKDIR]" << std::endl;
+      return 2;
+    }
+  }
+
+  const std::string flatname = dir+"/bench_flat.root";
+  const std::string nestedname = dir+"/bench_nested.root";
+
+  WriteFlat(flatname, N);
+  WriteNested(nestedname, N);
+
+  // Timings of a reader that gets the wrong answer are meaningless
+  if(Verify(flatname, "flat") + Verify(nestedname, "nested") > 0) return 1;
+
+  BenchRead(flatname, "flat");
+  BenchRead(nestedname, "nested");
+
+  if(out.empty()){
+    WriteJSON(std::cout, N, label);
+  }
+  else{
+    std::ofstream fout(out);
+    WriteJSON(fout, N, label);
+  }
+
+  return 0;
+}
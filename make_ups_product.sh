@@ -13,7 +13,7 @@ prodname_lower=srproxy
 prodname_mixed=SRProxy
 prodname_upper=SRPROXY
 
-INCS="BasicTypesProxy.h BasicTypesProxy.cxx FlatBasicTypes.h IBranchPolicy.h"
+INCS="BasicTypesProxy.h BasicTypesProxy.cxx ColumnarFile.h CompareCAFs.h EventIndex.h FlatBasicTypes.h FlatConverter.h FlatMerge.h FlatSort.h IBranchPolicy.h ManifestPolicy.h NTupleFile.h TempFile.h ZoneMap.h"
 BINS='gen_srproxy'
 
 dest=$ups_dir/$prodname_lower/$version